@@ -1,5 +1,5 @@
 // library_lms.cpp
-// Compile: g++ library_lms.cpp -o library_lms -std=c++17 -lsqlite3
+// Compile: g++ library_lms.cpp -o library_lms -std=c++17 -lsqlite3 -pthread
 
 #include <iostream>
 #include <iomanip>
@@ -8,96 +8,814 @@
 #include <ctime>
 #include <chrono>
 #include <sstream>
+#include <fstream>
 #include <sqlite3.h>
 #include <cstdlib>
 #include <cctype>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <map>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <csignal>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <strings.h>
+#include <cerrno>
+#include <stdexcept>
+#include <algorithm>
+#include <random>
+#include <array>
+#include <cstdint>
 
 using namespace std;
 
 const string DBFILE = "library.db";
-const int FINE_PER_DAY = 2;
-const int DEFAULT_BORROW_STUDENT = 14;
-const int DEFAULT_BORROW_FACULTY = 30;
-const int DEFAULT_BORROW_STAFF = 21;
+// Database opened by init_db and by every server worker; --bench swaps in
+// a scratch file.
+static string DB_PATH = DBFILE;
 
-sqlite3 *DB = nullptr;
+// Each thread owns its connection (and statement cache below): the terminal
+// program has one, --serve opens one per worker.
+thread_local sqlite3 *DB = nullptr;
+// Branch shard DB belongs to (see Branch shards); 0 is DB_PATH itself.
+// Main plus SQLite's default limit of 10 attached databases.
+const int MAX_SHARDS = 11;
+// Pseudo-shard for the read-only connection that attaches every shard.
+const int GATHER_CONN = MAX_SHARDS;
+thread_local int CUR_SHARD = 0;
+
+// -------------------- Dates --------------------
+// Dates are stored as INTEGER Unix seconds (UTC). Day arithmetic works on
+// epoch days (seconds / 86400); text is only produced for display.
+using EpochSecs = long long;
+const long long SECS_PER_DAY = 86400;
+
+struct CivilDate { int y; unsigned m, d; };
+
+// Days since 1970-01-01 of a proleptic Gregorian date (H. Hinnant's algorithm).
+constexpr long long days_from_civil(int y, unsigned m, unsigned d){
+    y -= m <= 2;
+    const long long era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = (unsigned)(y - era * 400);
+    const unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long long)doe - 719468;
+}
+
+constexpr CivilDate civil_from_days(long long z){
+    z += 719468;
+    const long long era = (z >= 0 ? z : z - 146096) / 146097;
+    const unsigned doe = (unsigned)(z - era * 146097);
+    const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const unsigned mp = (5 * doy + 2) / 153;
+    const unsigned d = doy - (153 * mp + 2) / 5 + 1;
+    const unsigned m = mp < 10 ? mp + 3 : mp - 9;
+    return CivilDate{(int)(era * 400 + yoe) + (m <= 2), m, d};
+}
+
+static_assert(days_from_civil(1970, 1, 1) == 0, "epoch");
+static_assert(days_from_civil(2000, 3, 1) == 11017, "leap year");
+static_assert(civil_from_days(11016).m == 2 && civil_from_days(11016).d == 29, "round trip");
+
+constexpr long long epoch_day(EpochSecs t){
+    return (t >= 0 ? t : t - (SECS_PER_DAY - 1)) / SECS_PER_DAY;
+}
+
+static EpochSecs now_epoch(){
+    return chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Fixed-size text form of a date ("YYYY-MM-DD"), streamable without a heap string.
+struct DateText {
+    char buf[32];
+    string_view view() const { return string_view(buf, 10); }
+};
+
+static DateText date_text(EpochSecs t){
+    CivilDate c = civil_from_days(epoch_day(t));
+    DateText out;
+    snprintf(out.buf, sizeof(out.buf), "%04d-%02u-%02u", c.y % 10000, c.m, c.d);
+    return out;
+}
+
+static ostream &operator<<(ostream &os, const DateText &d){ return os << d.view(); }
 
 // -------------------- SQLite helpers --------------------
+static void close_db();
+
+// Fatal setup errors (bad arguments, unopenable files) only.
 static void die(const string &msg){
     cerr << msg << "\n";
-    if(DB) sqlite3_close(DB);
+    close_db();
     exit(1);
 }
 
-static string now_iso(){
-    using namespace std::chrono;
-    auto t = system_clock::now();
-    time_t tt = system_clock::to_time_t(t);
-    std::tm tm{};
-    gmtime_r(&tt, &tm); // UTC
-    char buf[32];
-    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
-    return string(buf);
+// SQLite failures are thrown, not fatal: a menu action, batch line or
+// service request that hits one fails on its own, its Transaction rolls
+// back while unwinding, and the process carries on. Only main() and the
+// one-shot modes let it end the run.
+struct DbError : runtime_error {
+    int code;
+    DbError(int code, const string &msg): runtime_error(msg), code(code) {}
+    bool busy() const { return (code & 0xff) == SQLITE_BUSY || (code & 0xff) == SQLITE_LOCKED; }
+};
+
+[[noreturn]] static void throw_db_error(int rc, const string &what, const char *sql){
+    throw DbError(rc, what + ": " + sqlite3_errmsg(DB) + "\nWhen running: " + sql);
+}
+
+// Contention that outlasts busy_timeout is retried a few more times with
+// exponential backoff (10, 20, 40... ms) before it is reported.
+const int BUSY_RETRIES = 4;
+const int BUSY_BACKOFF_MS = 10;
+
+static bool is_busy(int rc){ return (rc & 0xff) == SQLITE_BUSY || (rc & 0xff) == SQLITE_LOCKED; }
+
+// First step of a statement, retried on contention when that is safe:
+// outside a transaction each statement is atomic by itself, and SQLite
+// documents COMMIT as retryable after SQLITE_BUSY.
+static int first_step(sqlite3_stmt *stmt){
+    int rc = sqlite3_step(stmt);
+    for(int attempt = 0; is_busy(rc) && attempt < BUSY_RETRIES; ++attempt){
+        if(!sqlite3_get_autocommit(DB) && strncmp(sqlite3_sql(stmt), "COMMIT", 6) != 0) break;
+        sqlite3_reset(stmt);
+        this_thread::sleep_for(chrono::milliseconds(BUSY_BACKOFF_MS << attempt));
+        rc = sqlite3_step(stmt);
+    }
+    return rc;
+}
+
+// Prepared statements are cached per SQL template: the key is the literal SQL
+// text (with ? placeholders), so each statement is parsed and planned once and
+// afterwards only rebound and reset. Templates must be string literals.
+static thread_local unordered_map<string_view, sqlite3_stmt*> STMT_CACHE;
+
+static sqlite3_stmt *cached_stmt(const char *sql){
+    auto it = STMT_CACHE.find(sql);
+    if (it != STMT_CACHE.end()) return it->second;
+    sqlite3_stmt *stmt = nullptr;
+    int rc = sqlite3_prepare_v3(DB, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr);
+    if (rc != SQLITE_OK) throw_db_error(rc, "Failed to prepare query", sql);
+    STMT_CACHE.emplace(sql, stmt);
+    return stmt;
 }
 
-static string today_iso_date(){
-    auto s = now_iso();
-    return s.substr(0,10);
+// Text is bound with SQLITE_STATIC: arguments outlive the step loop below.
+static void bind_param(sqlite3_stmt *stmt, int i, const string &v){ sqlite3_bind_text(stmt, i, v.data(), (int)v.size(), SQLITE_STATIC); }
+static void bind_param(sqlite3_stmt *stmt, int i, string_view v){ sqlite3_bind_text(stmt, i, v.data(), (int)v.size(), SQLITE_STATIC); }
+static void bind_param(sqlite3_stmt *stmt, int i, const char *v){ sqlite3_bind_text(stmt, i, v, -1, SQLITE_STATIC); }
+static void bind_param(sqlite3_stmt *stmt, int i, int v){ sqlite3_bind_int(stmt, i, v); }
+static void bind_param(sqlite3_stmt *stmt, int i, long long v){ sqlite3_bind_int64(stmt, i, v); }
+template<class T>
+static void bind_param(sqlite3_stmt *stmt, int i, const optional<T> &v){
+    if (v) bind_param(stmt, i, *v);
+    else sqlite3_bind_null(stmt, i);
 }
 
-static string escape_sql(const string &s){
-    string out; out.reserve(s.size()*2);
-    for(char c: s){
-        if(c=='\'') out += "''";
-        else out.push_back(c);
+// Returns a cached statement to its idle state when the caller is done with it.
+struct StmtReset {
+    sqlite3_stmt *stmt;
+    ~StmtReset(){ sqlite3_reset(stmt); sqlite3_clear_bindings(stmt); }
+};
+
+template<class... Args>
+static sqlite3_stmt *bound_stmt(const char *sql, const Args&... args){
+    sqlite3_stmt *stmt = cached_stmt(sql);
+    int i = 0;
+    (bind_param(stmt, ++i, args), ...);
+    (void)i;
+    return stmt;
+}
+
+// -- Instrumentation. With LMS_PROFILE=1 (or LMS_PROFILE_FILE=path) in the
+// environment, every exec_sql/for_each_row call is timed and charged to its
+// SQL template, together with the rows it returned and the statement's
+// full-scan, sort and automatic-index counters. Off, the cost is one
+// relaxed load per call.
+static atomic<bool> PROFILE{false};
+static string PROFILE_FILE;
+
+const int LATENCY_BUCKETS = 24;     // bucket i: under 2^i microseconds
+
+struct QueryStats {
+    long long calls = 0, rows = 0, total_ns = 0, max_ns = 0;
+    long long fullscan = 0, sorts = 0, autoindex = 0, vm_steps = 0;
+    long long hist[LATENCY_BUCKETS] = {};
+
+    // upper bound (us) of the bucket holding the p-th fraction of calls
+    long long percentile_us(double p) const {
+        long long want = (long long)(p * calls), seen = 0;
+        for(int i = 0; i < LATENCY_BUCKETS; ++i){
+            seen += hist[i];
+            if(seen > want) return 1LL << i;
+        }
+        return 1LL << (LATENCY_BUCKETS - 1);
     }
-    return out;
+};
+
+static mutex PROFILE_LOCK;
+static unordered_map<string_view, QueryStats> QUERY_STATS;
+// Every open connection, for page-cache counters across server workers.
+static vector<sqlite3*> CONNECTIONS;
+
+// Charges one finished call of sql to its template.
+struct QueryTimer {
+    const char *sql;
+    sqlite3_stmt *stmt;
+    bool on = PROFILE.load(memory_order_relaxed);
+    chrono::steady_clock::time_point t0 = on? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+    long long rows = 0;
+
+    ~QueryTimer(){
+        if(!on) return;
+        long long ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count();
+        int bucket = 0;
+        while(bucket < LATENCY_BUCKETS - 1 && (1LL << bucket) * 1000 <= ns) ++bucket;
+        lock_guard<mutex> lock(PROFILE_LOCK);
+        QueryStats &s = QUERY_STATS[sql];
+        ++s.calls;
+        s.rows += rows;
+        s.total_ns += ns;
+        s.max_ns = max(s.max_ns, ns);
+        ++s.hist[bucket];
+        s.fullscan += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+        s.sorts += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+        s.autoindex += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+        s.vm_steps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+    }
+};
+
+struct PageCacheStats { long long hits = 0, misses = 0, used_bytes = 0; int connections = 0; };
+
+// Hits and misses of connections already closed.
+static PageCacheStats RETIRED_CACHE;
+
+static void add_cache_status(PageCacheStats &p, sqlite3 *db){
+    int cur = 0, hi = 0;
+    if(sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &cur, &hi, 0) == SQLITE_OK) p.hits += cur;
+    if(sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &cur, &hi, 0) == SQLITE_OK) p.misses += cur;
+}
+
+static PageCacheStats page_cache_stats(){
+    lock_guard<mutex> lock(PROFILE_LOCK);
+    PageCacheStats p = RETIRED_CACHE;
+    for(sqlite3 *db: CONNECTIONS){
+        add_cache_status(p, db);
+        int cur = 0, hi = 0;
+        if(sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_USED, &cur, &hi, 0) == SQLITE_OK) p.used_bytes += cur;
+        ++p.connections;
+    }
+    return p;
+}
+
+// Templates ordered by total time, copied out so callers format unlocked.
+static vector<pair<string_view, QueryStats>> query_stats_snapshot(){
+    vector<pair<string_view, QueryStats>> v;
+    {
+        lock_guard<mutex> lock(PROFILE_LOCK);
+        v.assign(QUERY_STATS.begin(), QUERY_STATS.end());
+    }
+    sort(v.begin(), v.end(), [](auto &a, auto &b){ return a.second.total_ns > b.second.total_ns; });
+    return v;
+}
+
+static void print_query_stats(ostream &os){
+    if(!PROFILE){ os << "Profiling is off; start with LMS_PROFILE=1.\n"; return; }
+    auto p = page_cache_stats();
+    os << "Page cache: " << p.hits << " hits, " << p.misses << " misses";
+    if(p.hits + p.misses > 0) os << " (" << fixed << setprecision(1) << 100.0 * p.hits / (p.hits + p.misses) << "%)";
+    os << ", " << p.used_bytes / 1024 << " KiB over " << p.connections << " connection(s)\n";
+    os << fixed << right << setw(9) << "calls" << setw(11) << "total ms" << setw(9) << "avg us" << setw(8) << "p50<us" << setw(8) << "p99<us"
+       << setw(10) << "max us" << setw(10) << "rows" << setw(9) << "fullscan" << setw(7) << "sorts" << setw(7) << "autoix" << "  sql\n";
+    for(auto &[sql, s]: query_stats_snapshot()){
+        string text(sql.substr(0, 90));
+        for(char &c: text) if(c == '\n') c = ' ';
+        os << setw(9) << s.calls << setw(11) << setprecision(1) << s.total_ns / 1e6 << setw(9) << s.total_ns / 1e3 / s.calls
+           << setw(8) << s.percentile_us(0.50) << setw(8) << s.percentile_us(0.99) << setw(10) << s.max_ns / 1000
+           << setw(10) << s.rows << setw(9) << s.fullscan << setw(7) << s.sorts << setw(7) << s.autoindex << "  " << text << "\n";
+    }
+    os << left;
+}
+
+static void dump_profile_file(){
+    if(PROFILE_FILE.empty()) return;
+    string tmp = PROFILE_FILE + ".tmp";
+    {
+        ofstream out(tmp);
+        print_query_stats(out);
+    }
+    rename(tmp.c_str(), PROFILE_FILE.c_str());
+}
+
+// Reads LMS_PROFILE / LMS_PROFILE_FILE; the file is rewritten at exit.
+static void init_profiling(){
+    const char *on = getenv("LMS_PROFILE"), *file = getenv("LMS_PROFILE_FILE");
+    if(file && *file){ PROFILE_FILE = file; atexit(dump_profile_file); }
+    PROFILE = (on && *on && strcmp(on, "0") != 0) || !PROFILE_FILE.empty();
 }
 
-static void exec_sql(const string &sql){
+// One-shot scripts (DDL, seed data) that are not worth caching.
+static void exec_script(const char *sql){
     char *err = nullptr;
-    if (sqlite3_exec(DB, sql.c_str(), nullptr, nullptr, &err) != SQLITE_OK){
+    int rc = sqlite3_exec(DB, sql, nullptr, nullptr, &err);
+    if (rc != SQLITE_OK){
         string e = err? err : "Unknown sqlite error";
         sqlite3_free(err);
-        die("SQL error: " + e + "\nWhen running: " + sql);
+        throw DbError(rc, "SQL error: " + e + "\nWhen running: " + sql);
     }
 }
 
-static vector<vector<string>> query_sql(const string &sql){
+template<class... Args>
+static void exec_sql(const char *sql, const Args&... args){
+    sqlite3_stmt *stmt = bound_stmt(sql, args...);
+    StmtReset guard{stmt};
+    QueryTimer timer{sql, stmt};
+    int rc = first_step(stmt);
+    while (rc == SQLITE_ROW) rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) throw_db_error(rc, "SQL error", sql);
+}
+
+// View of the current result row, read straight out of the statement. The
+// string_views are only valid until the callback returns.
+struct Row {
+    sqlite3_stmt *stmt;
+    int size() const { return sqlite3_column_count(stmt); }
+    bool is_null(int i) const { return sqlite3_column_type(stmt, i) == SQLITE_NULL; }
+    bool is_int(int i) const { return sqlite3_column_type(stmt, i) == SQLITE_INTEGER; }
+    string_view name(int i) const { return sqlite3_column_name(stmt, i); }
+    string_view text(int i) const {
+        const unsigned char *p = sqlite3_column_text(stmt, i);
+        return p? string_view((const char*)p, (size_t)sqlite3_column_bytes(stmt, i)) : string_view();
+    }
+    long long int64(int i) const { return sqlite3_column_int64(stmt, i); }
+    int integer(int i) const { return sqlite3_column_int(stmt, i); }
+};
+
+// Streams each result row to fn(const Row&) without copying it anywhere.
+template<class Fn, class... Args>
+static void for_each_row(const char *sql, Fn &&fn, const Args&... args){
+    sqlite3_stmt *stmt = bound_stmt(sql, args...);
+    StmtReset guard{stmt};
+    QueryTimer timer{sql, stmt};
+    Row row{stmt};
+    for (int rc = first_step(stmt);; rc = sqlite3_step(stmt)){
+        if (rc == SQLITE_ROW){ ++timer.rows; fn(row); }
+        else if (rc == SQLITE_DONE) break;
+        else throw_db_error(rc, "Error stepping statement", sql);
+    }
+}
+
+// Materializes the whole result; meant for the short lookups that need
+// their values after the statement is reset.
+template<class... Args>
+static vector<vector<string>> query_sql(const char *sql, const Args&... args){
     vector<vector<string>> rows;
-    sqlite3_stmt *stmt = nullptr;
-    if (sqlite3_prepare_v2(DB, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK){
-        die("Failed to prepare query: " + sql);
+    for_each_row(sql, [&](const Row &r){
+        vector<string> row;
+        int cols = r.size();
+        row.reserve(cols);
+        for (int i=0;i<cols;++i) row.emplace_back(r.text(i));
+        rows.push_back(move(row));
+    }, args...);
+    return rows;
+}
+
+// One BEGIN IMMEDIATE...COMMIT unit: the write lock is taken up front so the
+// reads that validate an operation see the same state the writes apply to.
+// Leaving the scope without commit() rolls everything back. Opened inside
+// another transaction (batch mode groups) it becomes a savepoint, so one
+// failed operation only undoes its own writes. Top-level transactions also
+// hold their shard's WRITE_LOCKS entry, so writers from different worker
+// connections queue here instead of spinning in SQLite's busy handler,
+// while writes to different branches proceed side by side.
+static mutex WRITE_LOCKS[MAX_SHARDS];
+
+// One circulation event's share of the write-behind statistics (see
+// Write-behind): an issue bumps the book's borrowed_count, both kinds add
+// to daily_stats and category_loans. Queued per shard while the event's
+// transaction is open and handed over only when it commits.
+struct StatDelta {
+    string book_id;           // issues only
+    string category;
+    long long day = 0;
+    int issues = 0, returns = 0, fines = 0;
+};
+static thread_local vector<StatDelta> UNCOMMITTED_STATS[MAX_SHARDS];
+static void publish_stats(vector<StatDelta> &deltas, int shard);
+
+// A loan's change to a book's copies on the shelf, likewise held back
+// until commit before it reaches the Catalog cache, so a rolled back batch
+// group leaves the cache as it was.
+struct CopyDelta {
+    string book_id;
+    int delta;
+};
+static thread_local vector<CopyDelta> UNCOMMITTED_COPIES[MAX_SHARDS];
+static void publish_copies(vector<CopyDelta> &deltas);
+
+struct Transaction {
+    bool done = false;
+    bool nested;
+    int shard = CUR_SHARD;
+    size_t stats_mark = UNCOMMITTED_STATS[CUR_SHARD].size();
+    size_t copies_mark = UNCOMMITTED_COPIES[CUR_SHARD].size();
+    unique_lock<mutex> writer;
+    Transaction(): nested(!sqlite3_get_autocommit(DB)){
+        if(!nested) writer = unique_lock<mutex>(WRITE_LOCKS[CUR_SHARD]);
+        exec_sql(nested? "SAVEPOINT op;" : "BEGIN IMMEDIATE;");
     }
-    int cols = sqlite3_column_count(stmt);
-    while (true){
-        int rc = sqlite3_step(stmt);
-        if (rc == SQLITE_ROW){
-            vector<string> row;
-            for (int i=0;i<cols;++i){
-                const unsigned char *text = sqlite3_column_text(stmt, i);
-                row.push_back(text? string((const char*)text) : string());
+    // Gives up instead of waiting when another transaction holds the write
+    // lock; nothing is opened then, see active().
+    explicit Transaction(try_to_lock_t): nested(!sqlite3_get_autocommit(DB)){
+        if(!nested && !(writer = unique_lock<mutex>(WRITE_LOCKS[CUR_SHARD], try_to_lock))){ done = true; return; }
+        exec_sql(nested? "SAVEPOINT op;" : "BEGIN IMMEDIATE;");
+    }
+    bool active() const { return !done; }
+    Transaction(const Transaction&) = delete;
+    Transaction &operator=(const Transaction&) = delete;
+    void commit(){
+        exec_sql(nested? "RELEASE op;" : "COMMIT;");
+        done = true;
+        if(!nested){
+            publish_stats(UNCOMMITTED_STATS[shard], shard);
+            publish_copies(UNCOMMITTED_COPIES[shard]);
+        }
+    }
+    // Runs during unwinding, so it must not throw. If SQLite already rolled
+    // the whole transaction back (some errors do), there is nothing to undo.
+    ~Transaction(){
+        if(done) return;
+        auto &stats = UNCOMMITTED_STATS[shard];
+        stats.resize(nested? min(stats_mark, stats.size()) : 0);
+        auto &copies = UNCOMMITTED_COPIES[shard];
+        copies.resize(nested? min(copies_mark, copies.size()) : 0);
+        if(sqlite3_get_autocommit(DB)) return;
+        sqlite3_exec(DB, nested? "ROLLBACK TO op; RELEASE op;" : "ROLLBACK;", nullptr, nullptr, nullptr);
+    }
+};
+
+// Rows changed by the last INSERT/UPDATE/DELETE on this connection.
+static int changes(){ return sqlite3_changes(DB); }
+
+// Keyset pagination over a query whose first column is the key and whose
+// last parameter is LIMIT: fetches one extra row to learn whether another
+// page follows, and leaves the last key shown in next.
+template<class Fn, class... Args>
+static bool for_each_page(const char *sql, int limit, string &next, Fn &&fn, const Args&... args){
+    int n = 0;
+    bool more = false;
+    for_each_row(sql, [&](const Row &r){
+        if(n++ == limit){ more = true; return; }
+        next.assign(r.text(0));
+        fn(r);
+    }, args..., limit + 1);
+    return more;
+}
+
+// Connections of the shards this thread is not using right now, with
+// their statement caches; ShardScope swaps them in and out.
+struct ParkedConn {
+    sqlite3 *db = nullptr;
+    unordered_map<string_view, sqlite3_stmt*> stmts;
+};
+static thread_local ParkedConn PARKED[MAX_SHARDS + 1];
+
+static void close_current(){
+    for (auto &kv: STMT_CACHE) sqlite3_finalize(kv.second);
+    STMT_CACHE.clear();
+    if (DB){
+        lock_guard<mutex> lock(PROFILE_LOCK);
+        CONNECTIONS.erase(remove(CONNECTIONS.begin(), CONNECTIONS.end(), DB), CONNECTIONS.end());
+        add_cache_status(RETIRED_CACHE, DB);
+        sqlite3_close(DB);
+    }
+    DB = nullptr;
+}
+
+// Closes every connection this thread holds.
+static void close_db(){
+    close_current();
+    for (auto &p: PARKED){
+        if (!p.db) continue;
+        DB = p.db;
+        p.db = nullptr;
+        STMT_CACHE.swap(p.stmts);
+        close_current();
+    }
+    CUR_SHARD = 0;
+}
+
+// -------------------- Branch shards --------------------
+// With LMS_BRANCHES set (e.g. "eng:E,sci:S,sci:SC"), each branch gets its
+// own database next to DB_PATH (library-eng.db, ...) holding the books
+// whose rack starts with one of its prefixes, their loans and their hold
+// queues; everything else stays in DB_PATH, shard 0, which also keeps the
+// authoritative users table. Every shard has the full schema, so the
+// circulation code runs unchanged on whichever shard ShardScope selects,
+// and each shard has its own write lock. Members are copied into a branch
+// shard the first time they borrow or reserve there. Reads that span the
+// campus are one UNION ALL statement (gather_sql) on a separate read-only
+// connection that attaches every shard: a BEGIN IMMEDIATE on a connection
+// locks all of its attached databases, so the writing connections attach
+// nothing. Gathered reads see committed data only. Unset, there is one
+// shard and gathers run on its own connection.
+struct Shard {
+    string name, path;
+    vector<string> racks;     // rack prefixes routed here
+};
+static vector<Shard> SHARDS;
+
+static int shard_count(){ return SHARDS.empty()? 1 : (int)SHARDS.size(); }
+static const string &shard_path(int s){ return s == 0 || s == GATHER_CONN? DB_PATH : SHARDS[s].path; }
+static int gather_conn(){ return shard_count() == 1? 0 : GATHER_CONN; }
+
+// Reads LMS_BRANCHES ("name:rack-prefix" entries, comma separated; repeat a
+// name for more prefixes). Call once DB_PATH is final.
+static void init_shards(){
+    const char *env = getenv("LMS_BRANCHES");
+    if(!env || !*env) return;
+    string stem = DB_PATH.size() > 3 && DB_PATH.compare(DB_PATH.size() - 3, 3, ".db") == 0? DB_PATH.substr(0, DB_PATH.size() - 3) : DB_PATH;
+    SHARDS = {Shard{"main", DB_PATH, {}}};
+    stringstream ss(env);
+    for(string entry; getline(ss, entry, ',');){
+        size_t colon = entry.find(':');
+        string name = entry.substr(0, colon), prefix = colon == string::npos? string() : entry.substr(colon + 1);
+        if(name.empty() || prefix.empty() || name.find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789_") != string::npos)
+            die("LMS_BRANCHES entries are name:rack-prefix with a lowercase name, got \"" + entry + "\"");
+        auto it = find_if(SHARDS.begin() + 1, SHARDS.end(), [&](const Shard &s){ return s.name == name; });
+        if(it == SHARDS.end()){
+            if((int)SHARDS.size() == MAX_SHARDS) die("At most " + to_string(MAX_SHARDS - 1) + " branches");
+            SHARDS.push_back(Shard{name, stem + "-" + name + ".db", {}});
+            it = SHARDS.end() - 1;
+        }
+        it->racks.push_back(prefix);
+    }
+}
+
+// Longest matching rack prefix wins; unmatched racks stay in shard 0.
+static int shard_for_rack(string_view rack){
+    int best = 0;
+    size_t best_len = 0;
+    for(int s = 1; s < shard_count(); ++s)
+        for(auto &p: SHARDS[s].racks)
+            if(p.size() > best_len && rack.substr(0, p.size()) == p){ best = s; best_len = p.size(); }
+    return best;
+}
+
+static void open_db();
+
+// Makes shard s this thread's current connection (opening it on first
+// use unless told not to) and parks the previous one; scopes nest.
+static void switch_shard(int s, bool open = true){
+    if(s == CUR_SHARD) return;
+    ParkedConn &from = PARKED[CUR_SHARD], &to = PARKED[s];
+    from.db = DB;
+    from.stmts.swap(STMT_CACHE);
+    DB = to.db;
+    to.db = nullptr;
+    STMT_CACHE.swap(to.stmts);
+    CUR_SHARD = s;
+    if(!DB && open) open_db();
+}
+
+struct ShardScope {
+    int prev;
+    explicit ShardScope(int s): prev(CUR_SHARD){ switch_shard(s); }
+    ShardScope(const ShardScope&) = delete;
+    ShardScope &operator=(const ShardScope&) = delete;
+    ~ShardScope(){ switch_shard(prev, false); }
+};
+
+// Expands a per-shard query into one statement over every shard, run on
+// the gather_conn() connection. In arm, {s} is the shard's schema and {i} its
+// index; outer combines the arms, which it sees as {all}. Parameters must
+// be numbered (?1...), since every arm binds the same ones. With a single
+// shard the arm runs alone, so it must already produce the final order.
+// Expansions are built once and never freed, which keeps them valid as
+// STMT_CACHE keys.
+static const char *gather_sql(const char *arm, const char *outer){
+    static mutex lock;
+    static map<pair<const char*, const char*>, string> built;
+    lock_guard<mutex> guard(lock);
+    string &sql = built[{arm, outer}];
+    if(!sql.empty()) return sql.c_str();
+    auto expand = [&](int s){
+        string a = arm, schema = s == 0? "main" : "shard" + to_string(s);
+        for(size_t p; (p = a.find("{s}")) != string::npos;) a.replace(p, 3, schema);
+        for(size_t p; (p = a.find("{i}")) != string::npos;) a.replace(p, 3, to_string(s));
+        return a;
+    };
+    if(shard_count() == 1) sql = expand(0);
+    else {
+        string all = "(";
+        for(int s = 0; s < shard_count(); ++s) all += (s? " UNION ALL SELECT * FROM (" : "SELECT * FROM (") + expand(s) + ")";
+        all += ")";
+        sql = outer;
+        sql.replace(sql.find("{all}"), 5, all);
+    }
+    return sql.c_str();
+}
+
+template<class Fn, class... Args>
+static void for_each_gathered(const char *arm, const char *outer, Fn &&fn, const Args&... args){
+    ShardScope gather(gather_conn());
+    for_each_row(gather_sql(arm, outer), fn, args...);
+}
+
+// Shard holding book bid, or `missing` when no shard has it (by default 0,
+// where lookups then report it missing). Book ids are unique campus-wide.
+static int book_shard(const string &bid, int missing = 0){
+    if(shard_count() == 1) return 0;
+    int s = missing;
+    for_each_gathered("SELECT {i} AS shard FROM {s}.books WHERE book_id=?1", "SELECT shard FROM {all} LIMIT 1",
+                      [&](const Row &r){ s = r.integer(0); }, bid);
+    return s;
+}
+
+// Shard that recorded loan txn; next_txn_id keeps ids unique campus-wide.
+static int txn_shard(long long txn){
+    if(shard_count() == 1) return 0;
+    int s = 0;
+    for_each_gathered("SELECT {i} AS shard FROM {s}.transactions WHERE txn_id=?1", "SELECT shard FROM {all} LIMIT 1",
+                      [&](const Row &r){ s = r.integer(0); }, txn);
+    return s;
+}
+
+// -------------------- Write-behind --------------------
+// borrowed_count and the analytics tables (migration 8) are statistics
+// nobody at the desk waits for, so issues and returns leave them to a
+// background thread: each committed transaction's StatDeltas are merged
+// here per shard and group-committed within WRITE_BEHIND_DELAY (sooner
+// once WRITE_BEHIND_BATCH events pile up). Reports that show them call
+// flush_stats() first, and whatever is left is written at exit. A crash
+// loses at most the unflushed window; check-counters restores
+// borrowed_count from the loan history, not the daily totals.
+const auto WRITE_BEHIND_DELAY = chrono::milliseconds(200);
+const size_t WRITE_BEHIND_BATCH = 512;
+
+struct PendingStats {
+    unordered_map<string, int> borrowed;                    // book_id -> issues
+    map<long long, array<long long, 3>> days;               // -> issues, returns, fines
+    unordered_map<string, array<long long, 2>> categories;  // -> loans, fines
+    bool empty() const { return borrowed.empty() && days.empty() && categories.empty(); }
+};
+
+static mutex STATS_LOCK;        // guards the pending deltas and the thread state
+static condition_variable STATS_CV;
+static PendingStats PENDING_STATS[MAX_SHARDS];
+static size_t PENDING_EVENTS = 0;
+static thread STATS_THREAD;
+static bool STATS_STOP = false;
+// Held from taking the pending deltas until they commit, so flush_stats()
+// never returns while the background thread still has some in hand.
+static mutex STATS_APPLY_LOCK;
+
+static void merge_stats(PendingStats &into, const StatDelta &d){
+    if(!d.book_id.empty()) into.borrowed[d.book_id] += d.issues;
+    auto &day = into.days[d.day];
+    day[0] += d.issues; day[1] += d.returns; day[2] += d.fines;
+    auto &cat = into.categories[d.category];
+    cat[0] += d.issues; cat[1] += d.fines;
+}
+
+static void merge_stats(PendingStats &into, const PendingStats &from){
+    for(auto &[bid, n]: from.borrowed) into.borrowed[bid] += n;
+    for(auto &[day, v]: from.days){ auto &t = into.days[day]; for(int i = 0; i < 3; ++i) t[i] += v[i]; }
+    for(auto &[cat, v]: from.categories){ auto &t = into.categories[cat]; for(int i = 0; i < 2; ++i) t[i] += v[i]; }
+}
+
+// Writes out every delta published so far, one transaction per shard; a
+// shard whose write fails gets its deltas back for the next round. Where
+// this thread already has a transaction open (a batch group) they are
+// written inside it, under the lock it holds, and share its fate. Unless
+// wait is set, a shard whose write lock is busy is left for the next round
+// too, so the background thread never queues behind a long group while
+// holding STATS_APPLY_LOCK.
+static bool apply_pending_stats(bool wait){
+    lock_guard<mutex> applying(STATS_APPLY_LOCK);
+    PendingStats taken[MAX_SHARDS];
+    {
+        lock_guard<mutex> lock(STATS_LOCK);
+        for(int s = 0; s < MAX_SHARDS; ++s) swap(taken[s], PENDING_STATS[s]);
+        PENDING_EVENTS = 0;
+    }
+    bool ok = true;
+    for(int s = 0; s < MAX_SHARDS; ++s){
+        if(taken[s].empty()) continue;
+        try {
+            ShardScope shard(s);
+            if(!DB) open_db();          // the writer thread's own shard 0
+            optional<Transaction> tx;
+            if(wait) tx.emplace();
+            else if(!tx.emplace(try_to_lock).active()){
+                ok = false;
+                lock_guard<mutex> lock(STATS_LOCK);
+                merge_stats(PENDING_STATS[s], taken[s]);
+                ++PENDING_EVENTS;
+                continue;
             }
-            rows.push_back(row);
-        } else if (rc == SQLITE_DONE){
-            break;
-        } else {
-            sqlite3_finalize(stmt);
-            die("Error stepping statement");
+            for(auto &[bid, n]: taken[s].borrowed)
+                exec_sql("UPDATE books SET borrowed_count = borrowed_count + ? WHERE book_id=?;", n, bid);
+            for(auto &[day, v]: taken[s].days)
+                exec_sql("INSERT INTO daily_stats (day,issues,returns,fines) VALUES (?,?,?,?) ON CONFLICT(day) DO UPDATE "
+                         "SET issues = issues + excluded.issues, returns = returns + excluded.returns, fines = fines + excluded.fines;",
+                         day, v[0], v[1], v[2]);
+            for(auto &[cat, v]: taken[s].categories)
+                exec_sql("INSERT INTO category_loans (category,loans,fines) VALUES (?,?,?) ON CONFLICT(category) DO UPDATE "
+                         "SET loans = loans + excluded.loans, fines = fines + excluded.fines;", cat, v[0], v[1]);
+            tx->commit();
+        } catch(const DbError &e){
+            ok = false;
+            cerr << "Deferred statistics for " << shard_path(s) << " not written: " << e.what() << "\n";
+            lock_guard<mutex> lock(STATS_LOCK);
+            merge_stats(PENDING_STATS[s], taken[s]);
+            ++PENDING_EVENTS;
         }
     }
-    sqlite3_finalize(stmt);
-    return rows;
+    return ok;
 }
 
-// -------------------- DB init & seed --------------------
-static void init_db(){
-    if (sqlite3_open(DBFILE.c_str(), &DB) != SQLITE_OK){
-        die("Cannot open DB file: " + DBFILE);
+static void stats_writer(){
+    unique_lock<mutex> lock(STATS_LOCK);
+    while(true){
+        STATS_CV.wait(lock, []{ return STATS_STOP || PENDING_EVENTS > 0; });
+        STATS_CV.wait_for(lock, WRITE_BEHIND_DELAY, []{ return STATS_STOP || PENDING_EVENTS >= WRITE_BEHIND_BATCH; });
+        bool stop = STATS_STOP;
+        lock.unlock();
+        // retried on the next tick if a write lock was busy, but waited for
+        // on the way out
+        bool ok = apply_pending_stats(stop);
+        lock.lock();
+        // on the way out, one last try for anything published meanwhile
+        if(stop && (!ok || PENDING_EVENTS == 0)) break;
+    }
+    lock.unlock();
+    close_db();
+}
+
+// Writes the remaining deltas and stops the background thread; runs at
+// exit once the thread has started.
+static void stop_stats_writer(){
+    {
+        lock_guard<mutex> lock(STATS_LOCK);
+        if(!STATS_THREAD.joinable()) return;
+        // die() on the writer itself: nobody is left to wait for
+        if(STATS_THREAD.get_id() == this_thread::get_id()){ STATS_THREAD.detach(); return; }
+        STATS_STOP = true;
+    }
+    STATS_CV.notify_one();
+    STATS_THREAD.join();
+    STATS_STOP = false;
+}
+
+// Called by Transaction::commit() with the transaction's deltas.
+static void publish_stats(vector<StatDelta> &deltas, int shard){
+    if(deltas.empty()) return;
+    lock_guard<mutex> lock(STATS_LOCK);
+    for(auto &d: deltas) merge_stats(PENDING_STATS[shard], d);
+    PENDING_EVENTS += deltas.size();
+    deltas.clear();
+    if(!STATS_THREAD.joinable()){
+        static bool registered = false;
+        if(!registered){ atexit(stop_stats_writer); registered = true; }
+        STATS_THREAD = thread(stats_writer);
     }
+    if(PENDING_EVENTS >= WRITE_BEHIND_BATCH) STATS_CV.notify_one();
+}
+
+// Records d as part of the current transaction (published at once outside
+// one).
+static void queue_stats(StatDelta d){
+    auto &q = UNCOMMITTED_STATS[CUR_SHARD];
+    q.push_back(move(d));
+    if(sqlite3_get_autocommit(DB)) publish_stats(q, CUR_SHARD);
+}
+
+// Brings borrowed_count and the analytics tables up to date with every
+// committed issue and return. Inside a batch group that excludes the
+// group's own, which are published when it commits.
+static void flush_stats(){ apply_pending_stats(true); }
 
-    // Create tables if not exist
-    exec_sql(R"SQL(
+// -------------------- Schema migrations --------------------
+// Applied in order; PRAGMA user_version records how many have run, so an
+// existing library.db is upgraded in place the next time the program starts.
+// Never edit a shipped step: append a new one.
+static const char *const MIGRATIONS[] = {
+    // 1: base schema (IF NOT EXISTS so pre-versioning databases adopt it)
+    R"SQL(
     CREATE TABLE IF NOT EXISTS users (
         id TEXT PRIMARY KEY,
         name TEXT NOT NULL,
@@ -105,9 +823,6 @@ static void init_db(){
         role TEXT NOT NULL,
         category TEXT
     );
-    )SQL");
-
-    exec_sql(R"SQL(
     CREATE TABLE IF NOT EXISTS books (
         book_id TEXT PRIMARY KEY,
         isbn TEXT,
@@ -120,9 +835,6 @@ static void init_db(){
         available_copies INTEGER NOT NULL DEFAULT 1,
         borrowed_count INTEGER NOT NULL DEFAULT 0
     );
-    )SQL");
-
-    exec_sql(R"SQL(
     CREATE TABLE IF NOT EXISTS transactions (
         txn_id TEXT PRIMARY KEY,
         member_id TEXT NOT NULL,
@@ -135,9 +847,6 @@ static void init_db(){
         FOREIGN KEY(member_id) REFERENCES users(id),
         FOREIGN KEY(book_id) REFERENCES books(book_id)
     );
-    )SQL");
-
-    exec_sql(R"SQL(
     CREATE TABLE IF NOT EXISTS reservations (
         res_id INTEGER PRIMARY KEY AUTOINCREMENT,
         book_id TEXT NOT NULL,
@@ -145,32 +854,1052 @@ static void init_db(){
         res_date TEXT NOT NULL,
         status TEXT NOT NULL
     );
-    )SQL");
+    )SQL",
+
+    // 2: secondary indexes for the hot filters
+    R"SQL(
+    CREATE INDEX IF NOT EXISTS idx_txn_member_status ON transactions(member_id, status);
+    CREATE INDEX IF NOT EXISTS idx_txn_borrowed_due ON transactions(due_date) WHERE status='borrowed';
+    CREATE INDEX IF NOT EXISTS idx_res_waiting ON reservations(book_id, res_date) WHERE status='waiting';
+    CREATE INDEX IF NOT EXISTS idx_books_borrowed_count ON books(borrowed_count DESC);
+    CREATE INDEX IF NOT EXISTS idx_users_role ON users(role);
+    )SQL",
+
+    // 3: full-text catalog search. books_fts is an external-content index
+    // over books.rowid kept in sync by triggers; isbn gets a plain index for
+    // the exact-match path.
+    R"SQL(
+    CREATE INDEX IF NOT EXISTS idx_books_isbn ON books(isbn);
+    CREATE VIRTUAL TABLE IF NOT EXISTS books_fts USING fts5(
+        title, author, isbn,
+        content='books', content_rowid='rowid', prefix='2 3'
+    );
+    CREATE TRIGGER IF NOT EXISTS books_fts_ai AFTER INSERT ON books BEGIN
+        INSERT INTO books_fts(rowid, title, author, isbn) VALUES (new.rowid, new.title, new.author, new.isbn);
+    END;
+    CREATE TRIGGER IF NOT EXISTS books_fts_ad AFTER DELETE ON books BEGIN
+        INSERT INTO books_fts(books_fts, rowid, title, author, isbn) VALUES ('delete', old.rowid, old.title, old.author, old.isbn);
+    END;
+    CREATE TRIGGER IF NOT EXISTS books_fts_au AFTER UPDATE OF title, author, isbn ON books BEGIN
+        INSERT INTO books_fts(books_fts, rowid, title, author, isbn) VALUES ('delete', old.rowid, old.title, old.author, old.isbn);
+        INSERT INTO books_fts(rowid, title, author, isbn) VALUES (new.rowid, new.title, new.author, new.isbn);
+    END;
+    INSERT INTO books_fts(books_fts) VALUES ('rebuild');
+    )SQL",
+
+    // 4: dates become INTEGER Unix seconds. Column affinity can't be changed
+    // in place, so both tables are rebuilt and their indexes recreated.
+    R"SQL(
+    CREATE TABLE transactions_v4 (
+        txn_id TEXT PRIMARY KEY,
+        member_id TEXT NOT NULL,
+        book_id TEXT NOT NULL,
+        issue_date INTEGER NOT NULL,
+        due_date INTEGER NOT NULL,
+        return_date INTEGER,
+        fine INTEGER DEFAULT 0,
+        status TEXT NOT NULL,
+        FOREIGN KEY(member_id) REFERENCES users(id),
+        FOREIGN KEY(book_id) REFERENCES books(book_id)
+    );
+    INSERT INTO transactions_v4
+        SELECT txn_id, member_id, book_id, CAST(strftime('%s', issue_date) AS INTEGER), CAST(strftime('%s', due_date) AS INTEGER),
+               CAST(strftime('%s', return_date) AS INTEGER), fine, status
+        FROM transactions;
+    DROP TABLE transactions;
+    ALTER TABLE transactions_v4 RENAME TO transactions;
+    CREATE INDEX idx_txn_member_status ON transactions(member_id, status);
+    CREATE INDEX idx_txn_borrowed_due ON transactions(due_date) WHERE status='borrowed';
+
+    CREATE TABLE reservations_v4 (
+        res_id INTEGER PRIMARY KEY AUTOINCREMENT,
+        book_id TEXT NOT NULL,
+        member_id TEXT NOT NULL,
+        res_date INTEGER NOT NULL,
+        status TEXT NOT NULL
+    );
+    INSERT INTO reservations_v4
+        SELECT res_id, book_id, member_id, CAST(strftime('%s', res_date) AS INTEGER), status FROM reservations;
+    DROP TABLE reservations;
+    ALTER TABLE reservations_v4 RENAME TO reservations;
+    CREATE INDEX idx_res_waiting ON reservations(book_id, res_date) WHERE status='waiting';
+    )SQL",
+
+    // 5: reservation queues. FIFO order is res_id (AUTOINCREMENT, so never
+    // reused); one waiting hold per member and book; indexes for bulk
+    // cancellation by member and expiry by age.
+    R"SQL(
+    DROP INDEX IF EXISTS idx_res_waiting;
+    UPDATE reservations SET status='cancelled'
+        WHERE status='waiting' AND res_id NOT IN
+            (SELECT MIN(res_id) FROM reservations WHERE status='waiting' GROUP BY book_id, member_id);
+    CREATE INDEX idx_res_queue ON reservations(book_id, res_id) WHERE status='waiting';
+    CREATE UNIQUE INDEX idx_res_one_per_member ON reservations(book_id, member_id) WHERE status='waiting';
+    CREATE INDEX idx_res_member ON reservations(member_id) WHERE status='waiting';
+    CREATE INDEX idx_res_age ON reservations(res_date) WHERE status='waiting';
+    )SQL",
+
+    // 6: txn_id becomes an INTEGER PRIMARY KEY (the rowid itself, no separate
+    // TEXT key index). Legacy "TX<ms>" ids map to ms << 22, the same value
+    // the generator would have produced; anything else gets a low sequence.
+    R"SQL(
+    CREATE TABLE transactions_v6 (
+        txn_id INTEGER PRIMARY KEY,
+        member_id TEXT NOT NULL,
+        book_id TEXT NOT NULL,
+        issue_date INTEGER NOT NULL,
+        due_date INTEGER NOT NULL,
+        return_date INTEGER,
+        fine INTEGER DEFAULT 0,
+        status TEXT NOT NULL,
+        FOREIGN KEY(member_id) REFERENCES users(id),
+        FOREIGN KEY(book_id) REFERENCES books(book_id)
+    );
+    INSERT INTO transactions_v6
+        SELECT CASE WHEN txn_id GLOB 'TX[0-9]*' AND substr(txn_id, 3) NOT GLOB '*[^0-9]*'
+                    THEN CAST(substr(txn_id, 3) AS INTEGER) << 22
+                    ELSE ((issue_date * 1000) << 22) + 1 + (rowid % 4194303) END,
+               member_id, book_id, issue_date, due_date, return_date, fine, status
+        FROM transactions;
+    DROP TABLE transactions;
+    ALTER TABLE transactions_v6 RENAME TO transactions;
+    CREATE INDEX idx_txn_member_status ON transactions(member_id, status);
+    CREATE INDEX idx_txn_borrowed_due ON transactions(due_date) WHERE status='borrowed';
+    )SQL",
+
+    // 7: materialized counters. users.active_loans (open loans per member)
+    // and books.waiting_holds (queue length) are kept by triggers, so the
+    // borrow-limit check is a single-row read. Rebuilding transactions or
+    // reservations drops these triggers; recreate them in that migration.
+    R"SQL(
+    ALTER TABLE users ADD COLUMN active_loans INTEGER NOT NULL DEFAULT 0;
+    ALTER TABLE books ADD COLUMN waiting_holds INTEGER NOT NULL DEFAULT 0;
+    UPDATE users SET active_loans = (SELECT COUNT(*) FROM transactions t WHERE t.member_id=users.id AND t.status='borrowed');
+    UPDATE books SET waiting_holds = (SELECT COUNT(*) FROM reservations r WHERE r.book_id=books.book_id AND r.status='waiting');
+    CREATE TRIGGER txn_loans_ai AFTER INSERT ON transactions WHEN new.status='borrowed' BEGIN
+        UPDATE users SET active_loans = active_loans + 1 WHERE id=new.member_id;
+    END;
+    CREATE TRIGGER txn_loans_au AFTER UPDATE OF status ON transactions
+    WHEN (old.status='borrowed') <> (new.status='borrowed') BEGIN
+        UPDATE users SET active_loans = active_loans + (CASE WHEN new.status='borrowed' THEN 1 ELSE -1 END) WHERE id=new.member_id;
+    END;
+    CREATE TRIGGER txn_loans_ad AFTER DELETE ON transactions WHEN old.status='borrowed' BEGIN
+        UPDATE users SET active_loans = active_loans - 1 WHERE id=old.member_id;
+    END;
+    CREATE TRIGGER res_holds_ai AFTER INSERT ON reservations WHEN new.status='waiting' BEGIN
+        UPDATE books SET waiting_holds = waiting_holds + 1 WHERE book_id=new.book_id;
+    END;
+    CREATE TRIGGER res_holds_au AFTER UPDATE OF status ON reservations
+    WHEN (old.status='waiting') <> (new.status='waiting') BEGIN
+        UPDATE books SET waiting_holds = waiting_holds + (CASE WHEN new.status='waiting' THEN 1 ELSE -1 END) WHERE book_id=new.book_id;
+    END;
+    CREATE TRIGGER res_holds_ad AFTER DELETE ON reservations WHEN old.status='waiting' BEGIN
+        UPDATE books SET waiting_holds = waiting_holds - 1 WHERE book_id=old.book_id;
+    END;
+    )SQL",
+
+    // 8: circulation analytics, maintained per issue/return by triggers so
+    // dashboards read only the rows they show. Days are UTC epoch days,
+    // matching the overdue report. Backfilled from existing history.
+    R"SQL(
+    CREATE TABLE daily_stats (
+        day INTEGER PRIMARY KEY,
+        issues INTEGER NOT NULL DEFAULT 0,
+        returns INTEGER NOT NULL DEFAULT 0,
+        fines INTEGER NOT NULL DEFAULT 0
+    );
+    CREATE TABLE category_loans (
+        category TEXT PRIMARY KEY,
+        loans INTEGER NOT NULL DEFAULT 0,
+        fines INTEGER NOT NULL DEFAULT 0
+    ) WITHOUT ROWID;
+    INSERT INTO daily_stats (day,issues,returns,fines)
+        SELECT d, SUM(i), SUM(r), SUM(f) FROM (
+            SELECT issue_date/86400 AS d, 1 AS i, 0 AS r, 0 AS f FROM transactions
+            UNION ALL
+            SELECT return_date/86400, 0, 1, COALESCE(fine,0) FROM transactions WHERE status='returned' AND return_date IS NOT NULL)
+        GROUP BY d;
+    INSERT INTO category_loans (category,loans,fines)
+        SELECT COALESCE(u.category,''), COUNT(*), SUM(CASE WHEN t.status='returned' THEN COALESCE(t.fine,0) ELSE 0 END)
+        FROM transactions t LEFT JOIN users u ON u.id=t.member_id GROUP BY 1;
+    CREATE TRIGGER txn_stats_ai AFTER INSERT ON transactions BEGIN
+        INSERT INTO daily_stats (day,issues) VALUES (new.issue_date/86400, 1)
+            ON CONFLICT(day) DO UPDATE SET issues = issues + 1;
+        INSERT INTO category_loans (category,loans)
+            SELECT COALESCE((SELECT category FROM users WHERE id=new.member_id),''), 1 WHERE true
+            ON CONFLICT(category) DO UPDATE SET loans = loans + 1;
+    END;
+    CREATE TRIGGER txn_stats_au AFTER UPDATE OF status ON transactions
+    WHEN old.status='borrowed' AND new.status='returned' BEGIN
+        INSERT INTO daily_stats (day,returns,fines) VALUES (new.return_date/86400, 1, COALESCE(new.fine,0))
+            ON CONFLICT(day) DO UPDATE SET returns = returns + 1, fines = fines + excluded.fines;
+        INSERT INTO category_loans (category,fines)
+            SELECT COALESCE((SELECT category FROM users WHERE id=new.member_id),''), COALESCE(new.fine,0) WHERE true
+            ON CONFLICT(category) DO UPDATE SET fines = fines + excluded.fines;
+    END;
+    )SQL",
+
+    // 9: keyset pagination. Listings page by primary key within a filter, so
+    // each filter needs an index that yields the key in order.
+    R"SQL(
+    DROP INDEX IF EXISTS idx_users_role;
+    CREATE INDEX idx_users_role_id ON users(role, id);
+    CREATE INDEX idx_txn_open ON transactions(txn_id) WHERE status='borrowed';
+    )SQL",
+
+    // 10: incremental snapshots pick up loans returned since the base
+    // snapshot by return date.
+    R"SQL(
+    CREATE INDEX idx_txn_returned ON transactions(return_date) WHERE return_date IS NOT NULL;
+    )SQL",
+
+    // 11: borrowed_count and the analytics tables are written behind the
+    // circulation transactions (see Write-behind), so migration 8's
+    // per-loan triggers go.
+    R"SQL(
+    DROP TRIGGER txn_stats_ai;
+    DROP TRIGGER txn_stats_au;
+    )SQL",
+
+    // 12: loan policy (see Loan policy), seeded with the rules that used to
+    // be hardcoded, plus a short-loan class for books.
+    R"SQL(
+    CREATE TABLE loan_policy (
+        category TEXT NOT NULL,         -- member category or '*'
+        book_class TEXT NOT NULL,       -- books.loan_class or '*'
+        loan_days INTEGER CHECK (loan_days > 0),
+        max_loans INTEGER CHECK (max_loans >= 0),
+        grace_days INTEGER CHECK (grace_days >= 0),
+        fine_per_day INTEGER CHECK (fine_per_day >= 0),
+        fine_cap INTEGER CHECK (fine_cap >= 0),
+        PRIMARY KEY (category, book_class)
+    ) WITHOUT ROWID;
+    INSERT INTO loan_policy VALUES
+        ('*', '*', 14, 5, 0, 2, 0),
+        ('faculty', '*', 30, 10, NULL, NULL, NULL),
+        ('staff', '*', 21, 7, NULL, NULL, NULL),
+        ('*', 'short', 3, NULL, NULL, 10, NULL);
+    ALTER TABLE books ADD COLUMN loan_class TEXT NOT NULL DEFAULT 'standard' CHECK (loan_class IN ('standard', 'short'));
+    )SQL",
+
+    // 13: role, category and the two status columns become small integers
+    // (see Stored codes). The three tables are rebuilt, which drops
+    // migration 7's triggers; they are recreated here with the new codes.
+    // An unknown value fails the NOT NULL/CHECK constraints and stops the
+    // upgrade rather than being guessed at.
+    R"SQL(
+    DROP TRIGGER txn_loans_ai; DROP TRIGGER txn_loans_au; DROP TRIGGER txn_loans_ad;
+    DROP TRIGGER res_holds_ai; DROP TRIGGER res_holds_au; DROP TRIGGER res_holds_ad;
 
-    // Seed default data only if users table empty
-    auto rows = query_sql("SELECT COUNT(*) FROM users;");
-    if (!rows.empty() && !rows[0].empty() && stoi(rows[0][0])==0){
-        // insert admin, staff, member
-        exec_sql("INSERT OR REPLACE INTO users (id,name,password,role,category) VALUES ('admin1','Library Admin','admin1','admin', NULL);");
-        exec_sql("INSERT OR REPLACE INTO users (id,name,password,role,category) VALUES ('staff1','Librarian','staff1','staff', NULL);");
-        exec_sql("INSERT OR REPLACE INTO users (id,name,password,role,category) VALUES ('m001','Alice Student','m001','member','student');");
+    CREATE TABLE users_v13 (
+        id TEXT PRIMARY KEY,
+        name TEXT NOT NULL,
+        password TEXT NOT NULL,
+        role INTEGER NOT NULL CHECK (role BETWEEN 0 AND 2),          -- admin, staff, member
+        category INTEGER CHECK (category BETWEEN 0 AND 2),           -- student, faculty, staff
+        active_loans INTEGER NOT NULL DEFAULT 0
+    );
+    INSERT INTO users_v13
+        SELECT id, name, password,
+               CASE role WHEN 'admin' THEN 0 WHEN 'staff' THEN 1 WHEN 'member' THEN 2 END,
+               CASE category WHEN 'student' THEN 0 WHEN 'faculty' THEN 1 WHEN 'staff' THEN 2 END,
+               active_loans
+        FROM users;
+    DROP TABLE users;
+    ALTER TABLE users_v13 RENAME TO users;
+    CREATE INDEX idx_users_role_id ON users(role, id);
+
+    CREATE TABLE transactions_v13 (
+        txn_id INTEGER PRIMARY KEY,
+        member_id TEXT NOT NULL,
+        book_id TEXT NOT NULL,
+        issue_date INTEGER NOT NULL,
+        due_date INTEGER NOT NULL,
+        return_date INTEGER,
+        fine INTEGER DEFAULT 0,
+        status INTEGER NOT NULL CHECK (status IN (0, 1)),            -- borrowed, returned
+        FOREIGN KEY(member_id) REFERENCES users(id),
+        FOREIGN KEY(book_id) REFERENCES books(book_id)
+    );
+    INSERT INTO transactions_v13
+        SELECT txn_id, member_id, book_id, issue_date, due_date, return_date, fine,
+               CASE status WHEN 'borrowed' THEN 0 WHEN 'returned' THEN 1 END
+        FROM transactions;
+    DROP TABLE transactions;
+    ALTER TABLE transactions_v13 RENAME TO transactions;
+    CREATE INDEX idx_txn_member_status ON transactions(member_id, status);
+    CREATE INDEX idx_txn_borrowed_due ON transactions(due_date) WHERE status=0;
+    CREATE INDEX idx_txn_open ON transactions(txn_id) WHERE status=0;
+    CREATE INDEX idx_txn_returned ON transactions(return_date) WHERE return_date IS NOT NULL;
+
+    CREATE TABLE reservations_v13 (
+        res_id INTEGER PRIMARY KEY AUTOINCREMENT,
+        book_id TEXT NOT NULL,
+        member_id TEXT NOT NULL,
+        res_date INTEGER NOT NULL,
+        status INTEGER NOT NULL CHECK (status BETWEEN 0 AND 3)       -- waiting, fulfilled, cancelled, expired
+    );
+    INSERT INTO reservations_v13
+        SELECT res_id, book_id, member_id, res_date,
+               CASE status WHEN 'waiting' THEN 0 WHEN 'fulfilled' THEN 1 WHEN 'cancelled' THEN 2 WHEN 'expired' THEN 3 END
+        FROM reservations;
+    DROP TABLE reservations;
+    ALTER TABLE reservations_v13 RENAME TO reservations;
+    CREATE INDEX idx_res_queue ON reservations(book_id, res_id) WHERE status=0;
+    CREATE UNIQUE INDEX idx_res_one_per_member ON reservations(book_id, member_id) WHERE status=0;
+    CREATE INDEX idx_res_member ON reservations(member_id) WHERE status=0;
+    CREATE INDEX idx_res_age ON reservations(res_date) WHERE status=0;
+
+    CREATE TRIGGER txn_loans_ai AFTER INSERT ON transactions WHEN new.status=0 BEGIN
+        UPDATE users SET active_loans = active_loans + 1 WHERE id=new.member_id;
+    END;
+    CREATE TRIGGER txn_loans_au AFTER UPDATE OF status ON transactions
+    WHEN (old.status=0) <> (new.status=0) BEGIN
+        UPDATE users SET active_loans = active_loans + (CASE WHEN new.status=0 THEN 1 ELSE -1 END) WHERE id=new.member_id;
+    END;
+    CREATE TRIGGER txn_loans_ad AFTER DELETE ON transactions WHEN old.status=0 BEGIN
+        UPDATE users SET active_loans = active_loans - 1 WHERE id=old.member_id;
+    END;
+    CREATE TRIGGER res_holds_ai AFTER INSERT ON reservations WHEN new.status=0 BEGIN
+        UPDATE books SET waiting_holds = waiting_holds + 1 WHERE book_id=new.book_id;
+    END;
+    CREATE TRIGGER res_holds_au AFTER UPDATE OF status ON reservations
+    WHEN (old.status=0) <> (new.status=0) BEGIN
+        UPDATE books SET waiting_holds = waiting_holds + (CASE WHEN new.status=0 THEN 1 ELSE -1 END) WHERE book_id=new.book_id;
+    END;
+    CREATE TRIGGER res_holds_ad AFTER DELETE ON reservations WHEN old.status=0 BEGIN
+        UPDATE books SET waiting_holds = waiting_holds - 1 WHERE book_id=old.book_id;
+    END;
+    )SQL",
+
+    // 14: the change log (see Change log), fed by triggers on transactions
+    // and reservations; a migration that rebuilds either table must
+    // recreate them. kind is a ChangeKind; a hold that leaves the queue
+    // logs 2 + its new status.
+    R"SQL(
+    CREATE TABLE change_log (
+        seq INTEGER PRIMARY KEY AUTOINCREMENT,
+        at INTEGER NOT NULL,
+        kind INTEGER NOT NULL CHECK (kind BETWEEN 0 AND 6),   -- issue, return, reserve, hold fulfilled/cancelled/expired, reset
+        member_id TEXT,
+        book_id TEXT,
+        txn_id INTEGER,
+        res_id INTEGER
+    );
+    CREATE INDEX idx_change_at ON change_log(at);
+    CREATE TRIGGER cdc_txn_ai AFTER INSERT ON transactions BEGIN
+        INSERT INTO change_log (at,kind,member_id,book_id,txn_id) VALUES (new.issue_date, 0, new.member_id, new.book_id, new.txn_id);
+    END;
+    CREATE TRIGGER cdc_txn_au AFTER UPDATE OF status ON transactions WHEN old.status=0 AND new.status=1 BEGIN
+        INSERT INTO change_log (at,kind,member_id,book_id,txn_id) VALUES (new.return_date, 1, new.member_id, new.book_id, new.txn_id);
+    END;
+    CREATE TRIGGER cdc_res_ai AFTER INSERT ON reservations BEGIN
+        INSERT INTO change_log (at,kind,member_id,book_id,res_id) VALUES (new.res_date, 2, new.member_id, new.book_id, new.res_id);
+    END;
+    CREATE TRIGGER cdc_res_au AFTER UPDATE OF status ON reservations WHEN old.status=0 AND new.status<>0 BEGIN
+        INSERT INTO change_log (at,kind,member_id,book_id,res_id)
+        VALUES (CAST(strftime('%s', 'now') AS INTEGER), 2 + new.status, new.member_id, new.book_id, new.res_id);
+    END;
+    )SQL",
+
+    // 15: the books_fts vocabulary, per column, for fuzzy search (see
+    // Fuzzy search).
+    R"SQL(
+    CREATE VIRTUAL TABLE books_vocab USING fts5vocab(books_fts, 'col');
+    )SQL",
+
+    // 16: members without a category borrow as students (member_category),
+    // and the write-behind counts them there; step 8 once filed them
+    // under ''.
+    R"SQL(
+    INSERT INTO category_loans (category,loans,fines)
+        SELECT 'student', loans, fines FROM category_loans WHERE category=''
+        ON CONFLICT(category) DO UPDATE SET loans = loans + excluded.loans, fines = fines + excluded.fines;
+    DELETE FROM category_loans WHERE category='';
+    )SQL",
+};
+const int SCHEMA_VERSION = sizeof(MIGRATIONS) / sizeof(MIGRATIONS[0]);
+
+static int schema_version(){
+    int version = 0;
+    for_each_row("PRAGMA user_version;", [&](const Row &r){ version = r.integer(0); });
+    if (version > SCHEMA_VERSION) die(shard_path(CUR_SHARD) + " schema version " + to_string(version) + " is newer than this program");
+    return version;
+}
+
+// A current schema costs one PRAGMA read. Otherwise the pending steps, the
+// version bump and, on a new database, seed() commit as one transaction;
+// the version is read again under its lock, in case another process
+// migrated first.
+static void migrate_schema(void (*seed)() = nullptr){
+    if (schema_version() == SCHEMA_VERSION) return;
+    Transaction tx;
+    int version = schema_version();
+    for (int v = version; v < SCHEMA_VERSION; ++v) exec_script(MIGRATIONS[v]);
+    exec_script(("PRAGMA user_version=" + to_string(SCHEMA_VERSION) + ";").c_str());
+    if (version == 0 && seed) seed();
+    tx.commit();
+    // refresh planner statistics for the new indexes; new tables have none
+    if (version > 0 && version < SCHEMA_VERSION) exec_script("ANALYZE;");
+}
+
+// -------------------- Stored codes --------------------
+// users.role, users.category, transactions.status and reservations.status
+// hold small integers (migration 13, with CHECK constraints): the enums
+// below, in order. The *_NAMES arrays are their text for prompts, CSV and
+// output (ColKind::Code). Statements spell the codes with the SQL_*
+// literals, which keeps them literals for the partial indexes.
+enum class Role { Admin, Staff, Member, Count };
+enum class MemberCategory { Student, Faculty, Staff, Count };
+enum class LoanStatus { Borrowed, Returned, Count };
+enum class HoldStatus { Waiting, Fulfilled, Cancelled, Expired, Count };
+enum class ChangeKind { Issue, Return, Reserve, HoldFulfilled, HoldCancelled, HoldExpired, Reset, Count };
+
+const char *const ROLE_NAMES[] = {"admin", "staff", "member"};
+const char *const CATEGORY_NAMES[] = {"student", "faculty", "staff"};
+const char *const LOAN_STATUS_NAMES[] = {"borrowed", "returned"};
+const char *const HOLD_STATUS_NAMES[] = {"waiting", "fulfilled", "cancelled", "expired"};
+const char *const CHANGE_NAMES[] = {"issue", "return", "reserve", "hold_fulfilled", "hold_cancelled", "hold_expired", "reset"};
+static_assert(size(ROLE_NAMES) == (size_t)Role::Count && size(CATEGORY_NAMES) == (size_t)MemberCategory::Count
+              && size(LOAN_STATUS_NAMES) == (size_t)LoanStatus::Count && size(HOLD_STATUS_NAMES) == (size_t)HoldStatus::Count
+              && size(CHANGE_NAMES) == (size_t)ChangeKind::Count, "code names");
+
+#define SQL_STUDENT "0"
+#define SQL_ADMIN "0"
+#define SQL_STAFF "1"
+#define SQL_MEMBER "2"
+#define SQL_BORROWED "0"
+#define SQL_RETURNED "1"
+#define SQL_WAITING "0"
+#define SQL_FULFILLED "1"
+#define SQL_CANCELLED "2"
+#define SQL_EXPIRED "3"
+
+template<size_t N>
+static int name_index(const char *const (&names)[N], string_view s){
+    for(size_t i = 0; i < N; ++i) if(s == names[i]) return (int)i;
+    return -1;
+}
+
+// A users.category value; members without one (NULL) borrow as students.
+static MemberCategory member_category(long long code){
+    return code > 0 && code < (long long)MemberCategory::Count? (MemberCategory)code : MemberCategory::Student;
+}
+
+// -------------------- Loan policy --------------------
+// Loan periods, limits, grace periods and fines come from the loan_policy
+// table (migration 12), one row per (member category, book class) with '*'
+// matching any. load_policy() folds the rows into POLICY, a dense cell per
+// pair, so issue, return and the fine reports pick their rule with two
+// array indexes. More specific rows override less specific ones
+// (*/* < category/* < */class < category/class) field by field; NULL
+// fields inherit. max_loans caps all of a member's loans, so only class
+// '*' rows set it. Rules are read from the main database at startup.
+enum class LoanClass { Standard, Short, Count };
+const char *const LOAN_CLASS_NAMES[] = {"standard", "short"};
+static_assert(size(LOAN_CLASS_NAMES) == (size_t)LoanClass::Count, "loan class names");
+
+// Defaults are the */* rule migration 12 seeds, for an emptied table.
+struct LoanRule {
+    int loan_days = 14;
+    int max_loans = 5;
+    int grace_days = 0;
+    int fine_per_day = 2;
+    int fine_cap = 0;           // 0: no cap
+};
+static LoanRule POLICY[(int)MemberCategory::Count][(int)LoanClass::Count];
+// whether grace, fine_per_day or fine_cap differ across categories / classes
+static bool FINES_BY_CATEGORY = false, FINES_BY_CLASS = false;
+
+// Books without a known class lend as standard loans.
+static LoanClass loan_class(string_view s){
+    int i = name_index(LOAN_CLASS_NAMES, s);
+    return i < 0? LoanClass::Standard : (LoanClass)i;
+}
+
+static const LoanRule &loan_rule(MemberCategory c, LoanClass k){ return POLICY[(int)c][(int)k]; }
+
+// Fine for a loan `days` days past its due day; days inside the grace
+// period are free.
+static int loan_fine(const LoanRule &r, long long days){
+    if(days <= r.grace_days) return 0;
+    long long fine = (days - r.grace_days) * r.fine_per_day;
+    return (int)(r.fine_cap > 0? min<long long>(fine, r.fine_cap) : fine);
+}
+
+// loan_fine(category, loan_class, days) for fines computed in SQL.
+static void sql_loan_fine(sqlite3_context *ctx, int, sqlite3_value **argv){
+    const unsigned char *cls = sqlite3_value_text(argv[1]);
+    MemberCategory cat = member_category(sqlite3_value_type(argv[0]) == SQLITE_NULL? -1 : sqlite3_value_int64(argv[0]));
+    sqlite3_result_int(ctx, loan_fine(loan_rule(cat, loan_class(cls? (const char*)cls : "")), sqlite3_value_int64(argv[2])));
+}
+
+static void load_policy(){
+    struct Entry { int cat, cls; optional<int> f[5]; };
+    vector<Entry> entries[4];   // by specificity
+    for_each_row("SELECT category,book_class,loan_days,max_loans,grace_days,fine_per_day,fine_cap FROM loan_policy;", [&](const Row &r){
+        Entry e;
+        e.cat = r.text(0) == "*"? -2 : name_index(CATEGORY_NAMES, r.text(0));
+        e.cls = r.text(1) == "*"? -2 : name_index(LOAN_CLASS_NAMES, r.text(1));
+        if(e.cat == -1 || e.cls == -1){
+            cerr << "loan_policy: unknown category or class in rule " << r.text(0) << "/" << r.text(1) << ", ignored\n";
+            return;
+        }
+        for(int i = 0; i < 5; ++i) if(!r.is_null(2 + i)) e.f[i] = (int)r.int64(2 + i);
+        if(e.cls >= 0 && e.f[1]){
+            cerr << "loan_policy: max_loans only applies to book_class '*', ignored in " << r.text(0) << "/" << r.text(1) << "\n";
+            e.f[1].reset();
+        }
+        entries[(e.cat >= 0) + 2 * (e.cls >= 0)].push_back(e);
+    });
+    for(auto &cats: POLICY) for(auto &cell: cats) cell = LoanRule{};
+    for(auto &level: entries)
+        for(auto &e: level)
+            for(int c = 0; c < (int)MemberCategory::Count; ++c)
+                for(int k = 0; k < (int)LoanClass::Count; ++k){
+                    if((e.cat >= 0 && e.cat != c) || (e.cls >= 0 && e.cls != k)) continue;
+                    LoanRule &rule = POLICY[c][k];
+                    int *field[5] = {&rule.loan_days, &rule.max_loans, &rule.grace_days, &rule.fine_per_day, &rule.fine_cap};
+                    for(int i = 0; i < 5; ++i) if(e.f[i]) *field[i] = *e.f[i];
+                }
+    auto same_fines = [](const LoanRule &a, const LoanRule &b){
+        return a.grace_days == b.grace_days && a.fine_per_day == b.fine_per_day && a.fine_cap == b.fine_cap;
+    };
+    FINES_BY_CATEGORY = FINES_BY_CLASS = false;
+    for(int c = 0; c < (int)MemberCategory::Count; ++c)
+        for(int k = 0; k < (int)LoanClass::Count; ++k){
+            if(!same_fines(POLICY[c][k], POLICY[0][k])) FINES_BY_CATEGORY = true;
+            if(!same_fines(POLICY[c][k], POLICY[c][0])) FINES_BY_CLASS = true;
+        }
+}
 
-        // sample books
-        exec_sql("INSERT OR REPLACE INTO books (book_id,isbn,title,author,publisher,year,rack,total_copies,available_copies) VALUES \
-            ('b001','9780131103627','The C Programming Language','Kernighan & Ritchie','Prentice Hall',1978,'R1-01',3,3);");
-        exec_sql("INSERT OR REPLACE INTO books (book_id,isbn,title,author,publisher,year,rack,total_copies,available_copies) VALUES \
-            ('b002','9780132350884','Clean Code','Robert C. Martin','Prentice Hall',2008,'R2-03',2,2);");
-        exec_sql("INSERT OR REPLACE INTO books (book_id,isbn,title,author,publisher,year,rack,total_copies,available_copies) VALUES \
-            ('b003','9780262033848','Introduction to Algorithms','Cormen et al.','MIT Press',2009,'R3-05',1,1);");
+static void print_policy(ostream &os){
+    os << left << setw(10) << "Category" << setw(10) << "Class" << right << setw(6) << "Days" << setw(7) << "Limit"
+       << setw(7) << "Grace" << setw(9) << "Fine/day" << setw(6) << "Cap" << "\n";
+    for(int c = 0; c < (int)MemberCategory::Count; ++c)
+        for(int k = 0; k < (int)LoanClass::Count; ++k){
+            const LoanRule &r = POLICY[c][k];
+            os << left << setw(10) << CATEGORY_NAMES[c] << setw(10) << LOAN_CLASS_NAMES[k] << right << setw(6) << r.loan_days
+               << setw(7) << r.max_loans << setw(7) << r.grace_days << setw(9) << r.fine_per_day << setw(6) << r.fine_cap << "\n";
+        }
+    os << left;
+}
+
+// -------------------- Change log --------------------
+// change_log (migration 14) is the append-only stream of circulation
+// events: loans issued and returned, holds placed and leaving the queue.
+// Triggers write it in the same transaction as the change, so every path
+// and every process feeds it. seq is AUTOINCREMENT and only grows, also
+// across prune_changes(). Each shard keeps its own log, so a cursor is the
+// last seq seen per shard ("12", or "12,4,7" with branches) and
+// read_changes() returns what follows it, shard by shard. A restore
+// appends a reset event: subscribers re-scan from there.
+//
+// Waiters in this process (the service's /changes long poll) are woken
+// through SQLite's hooks: the update hook notes a change_log insert on
+// this thread's connection and the WAL hook, which runs after the commit,
+// passes it on. Writes from other processes show up at the next poll.
+using ChangeCursor = vector<long long>;
+const int CHANGE_PAGE = 1000;
+const int CHANGE_POLL_MS = 500;
+const int CHANGE_MAX_WAIT_MS = 30000;
+const int WAL_CHECKPOINT_PAGES = 1000;      // SQLite's own auto-checkpoint threshold
+
+struct ChangeFeed {
+    mutex m;
+    condition_variable cv;
+    unsigned long long gen = 0;             // commits that logged changes, under m
+};
+static ChangeFeed CHANGE_FEED;
+static thread_local bool CHANGE_LOGGED = false;
+
+static void change_update_hook(void*, int op, const char*, const char *table, sqlite3_int64){
+    if(op == SQLITE_INSERT && strcmp(table, "change_log") == 0) CHANGE_LOGGED = true;
+}
+
+static void wake_change_waiters(){
+    { lock_guard<mutex> lk(CHANGE_FEED.m); ++CHANGE_FEED.gen; }
+    CHANGE_FEED.cv.notify_all();
+}
+
+// Setting a WAL hook replaces SQLite's auto-checkpoint, so this does it.
+// A rolled-back insert leaves CHANGE_LOGGED set, which only costs waiters
+// a spurious re-read.
+static int change_wal_hook(void*, sqlite3 *db, const char *schema, int pages){
+    if(CHANGE_LOGGED){
+        CHANGE_LOGGED = false;
+        wake_change_waiters();
     }
+    if(pages >= WAL_CHECKPOINT_PAGES) sqlite3_wal_checkpoint(db, schema);
+    return SQLITE_OK;
 }
 
-// -------------------- Utilities --------------------
-static string read_nonempty(const string &prompt){
-    string s;
-    do {
-        cout << prompt;
-        if(!getline(cin, s)) exit(0);
+static unsigned long long change_generation(){
+    lock_guard<mutex> lk(CHANGE_FEED.m);
+    return CHANGE_FEED.gen;
+}
+
+// Waits up to ms for a commit logging changes after generation seen.
+static void wait_for_changes(unsigned long long seen, int ms){
+    unique_lock<mutex> lk(CHANGE_FEED.m);
+    CHANGE_FEED.cv.wait_for(lk, chrono::milliseconds(ms), [&]{ return CHANGE_FEED.gen != seen; });
+}
+
+static bool parse_cursor(string_view s, ChangeCursor &c){
+    c.assign(shard_count(), 0);
+    if(s.empty()) return true;
+    for(int i = 0;; ++i){
+        size_t comma = s.find(',');
+        string_view part = s.substr(0, comma);
+        if(i == shard_count()) return false;
+        auto res = from_chars(part.data(), part.data() + part.size(), c[i]);
+        if(res.ec != errc() || res.ptr != part.data() + part.size() || c[i] < 0) return false;
+        if(comma == string_view::npos) return true;
+        s.remove_prefix(comma + 1);
+    }
+}
+
+static string cursor_text(const ChangeCursor &c){
+    string s;
+    for(size_t i = 0; i < c.size(); ++i) s += (i? "," : "") + to_string(c[i]);
+    return s;
+}
+
+// Calls fn(shard, row) for up to limit events after cursor, advancing it.
+// Rows are seq, at, kind, member_id, book_id, txn_id, res_id.
+template<class Fn>
+static int read_changes(ChangeCursor &cursor, int limit, Fn &&fn){
+    int n = 0;
+    for(int s = 0; s < shard_count() && n < limit; ++s){
+        ShardScope shard(s);
+        for_each_row("SELECT seq,at,kind,member_id,book_id,txn_id,res_id FROM change_log WHERE seq > ? ORDER BY seq LIMIT ?;", [&](const Row &r){
+            cursor[s] = r.int64(0);
+            ++n;
+            fn(s, r);
+        }, cursor[s], limit - n);
+    }
+    return n;
+}
+
+static void json_string(string &out, string_view s);
+
+// One event as a JSON object; resume, when given, is the cursor after it.
+static void change_json(string &out, int shard, const Row &r, const string *resume = nullptr){
+    out += "{\"seq\":" + to_string(r.int64(0)) + ",\"shard\":";
+    json_string(out, shard_count() == 1? "main" : SHARDS[shard].name);
+    out += ",\"at\":" + to_string(r.int64(1)) + ",\"event\":";
+    json_string(out, CHANGE_NAMES[r.integer(2)]);
+    if(!r.is_null(3)){ out += ",\"member_id\":"; json_string(out, r.text(3)); }
+    if(!r.is_null(4)){ out += ",\"book_id\":"; json_string(out, r.text(4)); }
+    if(!r.is_null(5)) out += ",\"txn_id\":\"" + to_string(r.int64(5)) + "\"";
+    if(!r.is_null(6)) out += ",\"res_id\":" + to_string(r.int64(6));
+    if(resume){ out += ",\"cursor\":"; json_string(out, *resume); }
+    out += '}';
+}
+
+// Drops events older than days from every shard; returns how many.
+static int prune_changes(int days){
+    int n = 0;
+    for(int s = 0; s < shard_count(); ++s){
+        ShardScope shard(s);
+        exec_sql("DELETE FROM change_log WHERE at < ?;", now_epoch() - days * SECS_PER_DAY);
+        n += changes();
+    }
+    return n;
+}
+
+// --changes [cursor] [--follow] prints the events after cursor as JSON
+// lines, each carrying the cursor to resume from; --follow keeps polling.
+static int run_changes(const string &from, bool follow){
+    ChangeCursor cursor;
+    if(!parse_cursor(from, cursor)) die("A cursor is one seq per shard, comma separated (" + to_string(shard_count()) + " shards)");
+    string line, resume;
+    while(true){
+        int n = read_changes(cursor, CHANGE_PAGE, [&](int s, const Row &r){
+            resume = cursor_text(cursor);
+            line.clear();
+            change_json(line, s, r, &resume);
+            cout << line << "\n";
+        });
+        if(n == CHANGE_PAGE) continue;
+        cout.flush();
+        if(!follow) return 0;
+        this_thread::sleep_for(chrono::milliseconds(CHANGE_POLL_MS));
+    }
+}
+
+// -------------------- DB init & seed --------------------
+// LMS_CACHE_KB sizes each connection's page cache (SQLite's 2 MB when
+// unset), LMS_MMAP_MB how much of the file it reads through a shared
+// memory map; short runs then find pages the OS already has instead of
+// reading them into a cold cache.
+const long long DEFAULT_MMAP_MB = 256;
+
+static long long env_size(const char *name, long long fallback){
+    const char *env = getenv(name);
+    if(!env || !*env) return fallback;
+    char *end;
+    long long v = strtoll(env, &end, 10);
+    if(*end || v < 0) die(string(name) + " must be a non-negative number");
+    return v;
+}
+
+// journal_mode: WAL lets readers run alongside the writer; NORMAL only
+// syncs at checkpoints, which is still crash-safe in WAL mode.
+// recursive_triggers: INSERT OR REPLACE must fire the books DELETE trigger
+// so books_fts drops the replaced row.
+static const char *connection_pragmas(){
+    static const string sql = []{
+        string s = "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL; PRAGMA recursive_triggers=ON;";
+        if(long long kb = env_size("LMS_CACHE_KB", 0)) s += " PRAGMA cache_size=-" + to_string(kb) + ";";
+        s += " PRAGMA mmap_size=" + to_string(env_size("LMS_MMAP_MB", DEFAULT_MMAP_MB) << 20) + ";";
+        return s;
+    }();
+    return sql.c_str();
+}
+
+// Opens this thread's connection to the current shard with the
+// per-connection settings.
+static void open_db(){
+    const string &path = shard_path(CUR_SHARD);
+    if (sqlite3_open(path.c_str(), &DB) != SQLITE_OK){
+        die("Cannot open DB file: " + path);
+    }
+    {
+        lock_guard<mutex> lock(PROFILE_LOCK);
+        CONNECTIONS.push_back(DB);
+    }
+    // other processes (or a checkpoint) may hold the lock briefly
+    sqlite3_busy_timeout(DB, 5000);
+    exec_script(connection_pragmas());
+    sqlite3_create_function(DB, "loan_fine", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, sql_loan_fine, nullptr, nullptr);
+    sqlite3_update_hook(DB, change_update_hook, nullptr);
+    sqlite3_wal_hook(DB, change_wal_hook, nullptr);
+    if (CUR_SHARD == GATHER_CONN){
+        for (int s = 1; s < shard_count(); ++s)
+            exec_sql("ATTACH DATABASE ?1 AS ?2;", SHARDS[s].path, "shard" + to_string(s));
+        exec_script("PRAGMA query_only=ON;");
+    }
+}
+
+// Default accounts and sample books for a new library; runs in the
+// transaction that creates its schema.
+static void seed_db(){
+    exec_script(R"SQL(
+    INSERT INTO users (id,name,password,role,category) VALUES
+        ('admin1', 'Library Admin', 'admin1', )SQL" SQL_ADMIN R"SQL(, NULL),
+        ('staff1', 'Librarian', 'staff1', )SQL" SQL_STAFF R"SQL(, NULL),
+        ('m001', 'Alice Student', 'm001', )SQL" SQL_MEMBER ", " SQL_STUDENT R"SQL();
+    INSERT INTO books (book_id,isbn,title,author,publisher,year,rack,total_copies,available_copies) VALUES
+        ('b001', '9780131103627', 'The C Programming Language', 'Kernighan & Ritchie', 'Prentice Hall', 1978, 'R1-01', 3, 3),
+        ('b002', '9780132350884', 'Clean Code', 'Robert C. Martin', 'Prentice Hall', 2008, 'R2-03', 2, 2),
+        ('b003', '9780262033848', 'Introduction to Algorithms', 'Cormen et al.', 'MIT Press', 2009, 'R3-05', 1, 1);
+    )SQL");
+}
+
+static void init_db(){
+    // branches first, so shard 0 attaches migrated schemas
+    for (int s = 1; s < shard_count(); ++s){
+        ShardScope branch(s);
+        migrate_schema();
+    }
+    open_db();
+    migrate_schema(seed_db);
+    load_policy();
+}
+
+// -------------------- Catalog cache --------------------
+// Hot book records, held in one fixed array of slots indexed by book_id with
+// CLOCK eviction, for reads outside a transaction (displays, listings).
+// Circulation writes in this process update it once their outermost
+// transaction commits (see CopyDelta), but the checks they make inside it
+// read the books table, since writes made by other processes are not seen
+// here; restart or use the bulk paths, which clear it.
+const size_t CATALOG_CACHE_SIZE = 4096;
+
+struct BookInfo {
+    string book_id, title, author, isbn;
+    int available = 0, total = 0;
+    LoanClass loan_class = LoanClass::Standard;
+};
+
+class CatalogCache {
+    struct Slot {
+        BookInfo book;
+        bool used = false;
+        atomic<bool> referenced{false};
+    };
+    // allocated by the first fill, so runs that never look a book up
+    // don't build CATALOG_CACHE_SIZE slots at startup
+    vector<Slot> slots;
+    size_t slot_count;
+    unordered_map<string, size_t> index;
+    size_t hand = 0;
+    mutable shared_mutex m;
+    // bumped by every write so a reader that missed can tell whether the row
+    // it loaded is already stale
+    atomic<unsigned long long> gen{0};
+
+    size_t claim_slot(){
+        while(true){
+            Slot &s = slots[hand];
+            size_t i = hand;
+            hand = (hand + 1) % slots.size();
+            if(!s.used) return i;
+            if(!s.referenced.exchange(false)){
+                index.erase(s.book.book_id);
+                s.used = false;
+                return i;
+            }
+        }
+    }
+    void put_locked(const BookInfo &b){
+        if(slots.empty()) slots = vector<Slot>(slot_count);
+        auto it = index.find(b.book_id);
+        size_t i = it != index.end()? it->second : claim_slot();
+        slots[i].book = b;
+        slots[i].used = true;
+        slots[i].referenced = true;
+        index[b.book_id] = i;
+    }
+
+public:
+    atomic<long long> hits{0}, misses{0};
+
+    explicit CatalogCache(size_t capacity): slot_count(capacity) {}
+
+    bool get(const string &id, BookInfo &out){
+        shared_lock<shared_mutex> lk(m);
+        auto it = index.find(id);
+        if(it == index.end()){ ++misses; return false; }
+        Slot &s = slots[it->second];
+        s.referenced = true;
+        out = s.book;
+        ++hits;
+        return true;
+    }
+    unsigned long long generation() const { return gen.load(); }
+    // Fills a miss, unless a write happened since the reader's generation().
+    void fill(const BookInfo &b, unsigned long long seen){
+        unique_lock<shared_mutex> lk(m);
+        if(gen.load() == seen) put_locked(b);
+    }
+    void put(const BookInfo &b){
+        unique_lock<shared_mutex> lk(m);
+        ++gen;
+        put_locked(b);
+    }
+    void adjust_available(const string &id, int delta){
+        unique_lock<shared_mutex> lk(m);
+        ++gen;
+        auto it = index.find(id);
+        if(it != index.end()) slots[it->second].book.available += delta;
+    }
+    void erase(const string &id){
+        unique_lock<shared_mutex> lk(m);
+        ++gen;
+        auto it = index.find(id);
+        if(it == index.end()) return;
+        slots[it->second].used = false;
+        index.erase(it);
+    }
+    void clear(){
+        unique_lock<shared_mutex> lk(m);
+        ++gen;
+        for(auto &s: slots) s.used = false;
+        index.clear();
+    }
+    size_t size() const { shared_lock<shared_mutex> lk(m); return index.size(); }
+    size_t capacity() const { return slot_count; }
+};
+
+static CatalogCache CATALOG(CATALOG_CACHE_SIZE);
+
+static void publish_copies(vector<CopyDelta> &deltas){
+    for(auto &d: deltas) CATALOG.adjust_available(d.book_id, d.delta);
+    deltas.clear();
+}
+
+// Queues a copy change made in the open transaction (see CopyDelta).
+static void queue_copies(const string &bid, int delta){
+    UNCOMMITTED_COPIES[CUR_SHARD].push_back(CopyDelta{bid, delta});
+}
+
+static optional<BookInfo> lookup_book(const string &bid){
+    BookInfo b;
+    if(CATALOG.get(bid, b)) return b;
+    auto seen = CATALOG.generation();
+    auto rows = query_sql("SELECT book_id,title,author,isbn,available_copies,total_copies,loan_class FROM books WHERE book_id=?;", bid);
+    if(rows.empty()) return nullopt;
+    auto &r = rows[0];
+    b = BookInfo{r[0], r[1], r[2], r[3], stoi(r[4]), stoi(r[5]), loan_class(r[6])};
+    CATALOG.fill(b, seen);
+    return b;
+}
+
+// Re-reads a book after an edit whose resulting values aren't known here.
+static void refresh_cached_book(const string &bid){
+    CATALOG.erase(bid);
+    lookup_book(bid);
+}
+
+// -------------------- Fuzzy search --------------------
+// Typo-tolerant fallback for find_books(). The index holds the title and
+// author vocabulary of books_fts (through books_vocab) and, per hashed
+// trigram bucket, the terms containing it, in one flat postings array.
+// Words are padded with '$' so that short words and word ends have
+// trigrams of their own. A misspelt word collects the terms sharing
+// enough of its trigrams (one edit breaks at most three), and those within
+// fuzzy_max_typos() by edit distance are its corrections. books_fts is
+// then searched for them, so results are always current. The vocabulary
+// is not: it is read on the first fuzzy search (--serve warms it at
+// startup), dropped by catalog writes in this process, and catalog writes
+// from other processes show up after a restart.
+const int FUZZY_BUCKET_BITS = 18;
+const size_t FUZZY_MAX_WORD = 64;           // a pattern fits one 64-bit word
+const int FUZZY_ALTERNATIVES = 4;           // corrections tried per word
+
+static int fuzzy_max_typos(size_t len){ return len < 3? 0 : len < 6? 1 : 2; }
+
+// Buckets of w's padded trigrams, without repeats.
+static void trigram_buckets(string_view w, vector<uint32_t> &out){
+    out.clear();
+    string p = "$" + string(w) + "$";
+    for(size_t i = 0; i + 3 <= p.size(); ++i){
+        uint32_t g = (unsigned char)p[i] << 16 | (unsigned char)p[i + 1] << 8 | (unsigned char)p[i + 2];
+        out.push_back(g * 2654435761u >> (32 - FUZZY_BUCKET_BITS));
+    }
+    sort(out.begin(), out.end());
+    out.erase(unique(out.begin(), out.end()), out.end());
+}
+
+// Levenshtein distance from a fixed pattern of 1 to 64 bytes, by Myers'
+// bit-vector algorithm: each text byte advances the whole DP column in a
+// few 64-bit operations, so a candidate costs O(text length).
+struct EditPattern {
+    uint64_t peq[256] = {};                 // bit i set where pattern[i] is the byte
+    int m;
+    explicit EditPattern(string_view p): m((int)p.size()){
+        for(int i = 0; i < m; ++i) peq[(unsigned char)p[i]] |= 1ULL << i;
+    }
+    int distance(string_view t) const {
+        uint64_t pv = ~0ULL, mv = 0, last = 1ULL << (m - 1);
+        int score = m;
+        for(unsigned char c: t){
+            uint64_t eq = peq[c], xv = eq | mv, xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv), mh = pv & xh;
+            if(ph & last) ++score;
+            else if(mh & last) --score;
+            ph = ph << 1 | 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+        }
+        return score;
+    }
+};
+
+struct FuzzyMatch {
+    string term;
+    int typos;
+};
+
+class FuzzyIndex {
+    vector<string> terms;                   // sorted
+    vector<uint32_t> docs;                  // books holding each term, for ties
+    vector<uint32_t> start, postings;       // bucket g's terms: postings[start[g]..start[g+1])
+    bool built = false;
+    mutable shared_mutex m;
+
+    void build_locked(){
+        terms.clear();
+        docs.clear();
+        // one row per term and column; the columns of a term are adjacent
+        for_each_gathered("SELECT term, doc FROM {s}.books_vocab WHERE col IN ('title','author')",
+                          "SELECT term, SUM(doc) FROM {all} GROUP BY term ORDER BY term", [&](const Row &r){
+            string_view t = r.text(0);
+            if(t.size() > FUZZY_MAX_WORD) return;
+            if(!terms.empty() && terms.back() == t){ docs.back() += r.integer(1); return; }
+            terms.emplace_back(t);
+            docs.push_back(r.integer(1));
+        });
+        start.assign((1 << FUZZY_BUCKET_BITS) + 1, 0);
+        vector<uint32_t> grams;
+        for(auto &t: terms){
+            trigram_buckets(t, grams);
+            for(uint32_t g: grams) ++start[g + 1];
+        }
+        for(size_t g = 1; g < start.size(); ++g) start[g] += start[g - 1];
+        postings.resize(start.back());
+        vector<uint32_t> fill(start.begin(), start.end() - 1);
+        for(uint32_t i = 0; i < terms.size(); ++i){
+            trigram_buckets(terms[i], grams);
+            for(uint32_t g: grams) postings[fill[g]++] = i;
+        }
+        built = true;
+    }
+
+public:
+    void warm(){
+        unique_lock<shared_mutex> lk(m);
+        if(!built) build_locked();
+    }
+    void invalidate(){
+        unique_lock<shared_mutex> lk(m);
+        built = false;
+    }
+
+    // Whether some term starts with word, as its FTS prefix query needs;
+    // sets corrections to the terms within fuzzy_max_typos() of it, fewest
+    // typos then most books first. word is lowercase.
+    bool lookup(string_view word, vector<FuzzyMatch> &corrections){
+        corrections.clear();
+        shared_lock<shared_mutex> lk(m);
+        while(!built){ lk.unlock(); warm(); lk.lock(); }
+        auto it = lower_bound(terms.begin(), terms.end(), word, [](const string &t, string_view w){ return string_view(t) < w; });
+        bool prefix = it != terms.end() && string_view(*it).substr(0, word.size()) == word;
+        int max_typos = fuzzy_max_typos(word.size());
+        if(max_typos == 0 || word.size() > FUZZY_MAX_WORD) return prefix;
+
+        // shared trigrams per term; only the touched counts are reset
+        static thread_local vector<uint8_t> counts;
+        static thread_local vector<uint32_t> touched;
+        counts.resize(terms.size());
+        vector<uint32_t> grams;
+        trigram_buckets(word, grams);
+        for(uint32_t g: grams)
+            for(uint32_t k = start[g]; k < start[g + 1]; ++k)
+                if(counts[postings[k]]++ == 0) touched.push_back(postings[k]);
+        int need = max(1, (int)grams.size() - 3 * max_typos);
+        EditPattern pattern(word);
+        struct Candidate { int typos; uint32_t docs, term; };
+        vector<Candidate> found;
+        for(uint32_t t: touched){
+            int len_gap = (int)terms[t].size() - (int)word.size();
+            if(counts[t] >= need && abs(len_gap) <= max_typos){
+                int d = pattern.distance(terms[t]);
+                if(d <= max_typos) found.push_back({d, docs[t], t});
+            }
+            counts[t] = 0;
+        }
+        touched.clear();
+        sort(found.begin(), found.end(), [](const Candidate &a, const Candidate &b){
+            return a.typos != b.typos? a.typos < b.typos : a.docs != b.docs? a.docs > b.docs : a.term < b.term;
+        });
+        for(size_t i = 0; i < found.size() && i < (size_t)FUZZY_ALTERNATIVES; ++i) corrections.push_back({terms[found[i].term], found[i].typos});
+        return prefix;
+    }
+    size_t size() const { shared_lock<shared_mutex> lk(m); return terms.size(); }
+};
+
+static FuzzyIndex FUZZY;
+
+// -------------------- Utilities --------------------
+static string read_nonempty(const string &prompt){
+    string s;
+    do {
+        cout << prompt;
+        if(!getline(cin, s)) exit(0);
         // trim
         size_t a = s.find_first_not_of(" \t\r\n");
         if (a==string::npos) s = "";
@@ -179,344 +1908,2888 @@ static string read_nonempty(const string &prompt){
     return s;
 }
 
-static string prompt(const string &p){
-    cout << p;
-    string s; getline(cin, s);
-    return s;
+static string prompt(const string &p){
+    cout << p;
+    string s; getline(cin, s);
+    return s;
+}
+
+// -- Paged listings. Filters shared by the list views; empty means any.
+const int PAGE_SIZE = 20;
+const int MAX_PAGE_SIZE = 1000;
+
+struct ListFilter {
+    bool available_only = false;    // books with a copy on the shelf
+    string author;                  // books: substring of author
+    optional<Role> role;            // users: one role
+    string member;                  // borrowed: one member's loans
+    bool overdue_only = false;      // borrowed: past due date
+};
+
+// Shows pages from page(after, next) until the last one or until the user
+// stops; each page resumes after the last key of the previous one.
+template<class PageFn>
+static void browse_pages(PageFn &&page){
+    string after;
+    while(true){
+        string next;
+        if(!page(after, next)) return;
+        string s = prompt("-- Enter for next page, q to stop: ");
+        if(!cin || s == "q" || s == "Q") return;
+        after = next;
+    }
+}
+
+static bool yes(const string &s){ return s == "y" || s == "Y" || s == "yes"; }
+
+// -------------------- Output --------------------
+// Listings and reports render into one reusable buffer that goes out in
+// OUTPUT_BLOCK-sized writes, instead of formatting row by row through
+// iostream manipulators. Table is for terminals; CSV and JSON for piping.
+// Blocks go through the stream (not stdout) so they stay ordered with
+// other cout output while sync_with_stdio is off.
+const size_t OUTPUT_BLOCK = 1 << 16;
+
+enum class OutFormat { Table, Csv, Json };
+
+static bool parse_format(string_view s, OutFormat &f){
+    if(s == "table") f = OutFormat::Table;
+    else if(s == "csv") f = OutFormat::Csv;
+    else if(s == "json") f = OutFormat::Json;
+    else return false;
+    return true;
+}
+
+static void json_string(string &out, string_view s){
+    out += '"';
+    for(char c: s){
+        switch(c){
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if((unsigned char)c < 0x20){
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+                    out += buf;
+                } else out += c;
+        }
+    }
+    out += '"';
+}
+
+static void csv_field(string &out, string_view s){
+    if(s.find_first_of(",\"\r\n") == string_view::npos){ out += s; return; }
+    out += '"';
+    for(char c: s){ if(c == '"') out += '"'; out += c; }
+    out += '"';
+}
+
+// How a result column is rendered. Id is an integer key that JSON carries
+// as a string (txn ids exceed a double's 53 bits); Code is a stored code
+// shown by its name (see Stored codes).
+enum class ColKind { Text, Int, Date, Id, Code };
+
+struct Column {
+    const char *label;  // table header; CSV/JSON use the SQL column name
+    int width;          // table width; 0 = unpadded last column, -1 = hidden
+    ColKind kind = ColKind::Text;
+    bool clip = false;  // table: cut text longer than the column
+    const char *const *names = nullptr;     // Code: name of each code
+};
+
+class RowWriter {
+public:
+    // out == nullptr keeps everything in the buffer for str().
+    RowWriter(OutFormat fmt, vector<Column> cols, ostream *out = &cout)
+        : fmt(fmt), cols(move(cols)), out(out) {
+        buf.reserve(OUTPUT_BLOCK + 4096);
+        if(fmt == OutFormat::Table){
+            for(auto &c: this->cols) if(c.width >= 0) pad(c.label, c.width, false);
+            buf += '\n';
+        } else if(fmt == OutFormat::Json) buf += '[';
+    }
+    ~RowWriter(){ finish(); }
+
+    void row(const Row &r){
+        if(fmt == OutFormat::Csv && rows == 0) csv_header(r);
+        if(fmt == OutFormat::Json) buf += rows? ",\n{" : "\n{";
+        bool first = true;
+        for(int i = 0; i < (int)cols.size() && i < r.size(); ++i){
+            const Column &c = cols[i];
+            if(c.width < 0) continue;
+            if(fmt == OutFormat::Csv && !first) buf += ',';
+            if(fmt == OutFormat::Json){
+                if(!first) buf += ',';
+                json_string(buf, r.name(i));
+                buf += ':';
+            }
+            first = false;
+            cell(c, r, i);
+        }
+        buf += fmt == OutFormat::Json? '}' : '\n';
+        ++rows;
+        if(buf.size() >= OUTPUT_BLOCK) flush();
+    }
+
+    void finish(){
+        if(done) return;
+        done = true;
+        if(fmt == OutFormat::Json){
+            buf += rows? "\n]" : "]";
+            if(out) buf += '\n';
+        }
+        flush();
+        if(out) out->flush();
+    }
+
+    void flush(){
+        if(!out) return;
+        out->write(buf.data(), buf.size());
+        buf.clear();
+    }
+
+    const string &str() const { return buf; }
+    long long count() const { return rows; }
+
+private:
+    OutFormat fmt;
+    vector<Column> cols;
+    ostream *out;
+    string buf;
+    long long rows = 0;
+    bool done = false;
+
+    void cell(const Column &c, const Row &r, int i){
+        char num[24];
+        string_view s;
+        bool quoted = fmt == OutFormat::Json;
+        DateText d;
+        if(r.is_null(i)){
+            if(fmt == OutFormat::Json){ buf += "null"; return; }
+        } else if(c.kind == ColKind::Date){
+            d = date_text(r.int64(i));
+            s = d.view();
+        } else if(c.kind == ColKind::Code){
+            s = c.names[r.integer(i)];
+        } else if(c.kind == ColKind::Int || c.kind == ColKind::Id){
+            s = string_view(num, to_chars(num, num + sizeof(num), r.int64(i)).ptr - num);
+            quoted = quoted && c.kind == ColKind::Id;
+        } else s = r.text(i);
+        if(fmt == OutFormat::Table) pad(s, c.width, c.clip);
+        else if(fmt == OutFormat::Csv) csv_field(buf, s);
+        else if(quoted) json_string(buf, s);
+        else buf += s;
+    }
+
+    // Left-aligned in width. Clipped columns cut longer text at a UTF-8
+    // boundary and mark it with "..."; others overflow by a space. Width 0
+    // means the last column: no padding.
+    void pad(string_view s, int width, bool clip){
+        if(width == 0){ buf += s; return; }
+        size_t w = width;
+        if(!clip && s.size() >= w){ buf += s; buf += ' '; return; }
+        if(clip && s.size() > w - 2){
+            size_t keep = w - 5;
+            while(keep > 0 && ((unsigned char)s[keep] & 0xC0) == 0x80) --keep;
+            buf.append(s.data(), keep);
+            buf += "...";
+            buf.append(w - keep - 3, ' ');
+        } else {
+            buf += s;
+            buf.append(w - s.size(), ' ');
+        }
+    }
+
+    void csv_header(const Row &r){
+        bool first = true;
+        for(int i = 0; i < (int)cols.size() && i < r.size(); ++i){
+            if(cols[i].width < 0) continue;
+            if(!first) buf += ',';
+            first = false;
+            csv_field(buf, r.name(i));
+        }
+        buf += '\n';
+    }
+};
+
+// -------------------- Authentication --------------------
+struct User {
+    string id,name;
+    Role role = Role::Member;
+    MemberCategory category = MemberCategory::Student;
+};
+
+static bool login(User &user){
+    cout << "\n--- Login ---\n";
+    string uid = read_nonempty("User ID: ");
+    string pwd = prompt("Password: ");
+    bool found = false;
+    for_each_row("SELECT id,name,role,category FROM users WHERE id=? AND password=?;", [&](const Row &r){
+        user.id = r.text(0);
+        user.name = r.text(1);
+        user.role = (Role)r.integer(2);
+        user.category = member_category(r.is_null(3)? -1 : r.int64(3));
+        found = true;
+    }, uid, pwd);
+    if (found){
+        cout << "Welcome " << user.name << " (" << ROLE_NAMES[(int)user.role] << ")\n";
+        return true;
+    } else {
+        cout << "Invalid credentials.\n";
+        return false;
+    }
+}
+
+// -------------------- Admin functions --------------------
+// Rows of (book_id, isbn, title, author, available_copies, total_copies)
+// after book_id `after`, a range on the primary key of every shard.
+template<class Fn>
+static bool page_books(const ListFilter &f, const string &after, int limit, string &next, Fn &&fn){
+    optional<string> author;
+    if(!f.author.empty()) author = "%" + f.author + "%";
+    ShardScope gather(gather_conn());
+    return for_each_page(gather_sql("SELECT book_id,isbn,title,author,available_copies,total_copies FROM {s}.books "
+                                    "WHERE book_id > ?1 AND (?2 = 0 OR available_copies > 0) AND (?3 IS NULL OR author LIKE ?3) "
+                                    "ORDER BY book_id LIMIT ?4", "SELECT * FROM {all} ORDER BY book_id LIMIT ?4"),
+                         limit, next, fn, after, (int)f.available_only, author);
+}
+
+static const vector<Column> BOOK_COLUMNS = {
+    {"ID", 8}, {"ISBN", 18}, {"Title", 40, ColKind::Text, true}, {"Author", 20, ColKind::Text, true},
+    {"Avail", 8, ColKind::Int}, {"Total", 8, ColKind::Int}};
+
+static void list_books(){
+    ListFilter f;
+    f.available_only = yes(prompt("Only available? (y/N): "));
+    f.author = prompt("Author contains (blank = any): ");
+    cout << "\nBooks:\n";
+    browse_pages([&](const string &after, string &next){
+        RowWriter w(OutFormat::Table, BOOK_COLUMNS);
+        return page_books(f, after, PAGE_SIZE, next, [&](const Row &r){ w.row(r); });
+    });
+}
+
+struct BookInput {
+    string book_id, isbn, title, author, publisher;
+    optional<int> year;
+    string rack;
+    int copies = 1;
+    LoanClass loan_class = LoanClass::Standard;
+};
+
+// A new book goes to the shard of its rack's branch; an existing one stays
+// where it is.
+static void save_book(const BookInput &b){
+    int s = book_shard(b.book_id, -1);
+    ShardScope shard(s < 0? shard_for_rack(b.rack) : s);
+    exec_sql("INSERT OR REPLACE INTO books (book_id,isbn,title,author,publisher,year,rack,total_copies,available_copies,loan_class) VALUES (?,?,?,?,?,?,?,?,?,?);",
+        b.book_id, b.isbn, b.title, b.author, b.publisher, b.year, b.rack, b.copies, b.copies, LOAN_CLASS_NAMES[(int)b.loan_class]);
+    CATALOG.put(BookInfo{b.book_id, b.title, b.author, b.isbn, b.copies, b.copies, b.loan_class});
+    FUZZY.invalidate();
+}
+
+static void add_book(){
+    cout << "\n--- Add Book ---\n";
+    string bid = read_nonempty("Book ID (unique): ");
+    string title = read_nonempty("Title: ");
+    string author = prompt("Author: ");
+    string isbn = prompt("ISBN: ");
+    string publisher = prompt("Publisher: ");
+    string year = prompt("Year (YYYY): ");
+    string rack = prompt("Rack No.: ");
+    string copies_s = prompt("Copies (default 1): ");
+    string cls;
+    while(true){
+        cls = prompt("Loan class (standard/short, default standard): ");
+        if(cls.empty() || name_index(LOAN_CLASS_NAMES, cls) >= 0) break;
+        cout << "Invalid loan class.\n";
+    }
+    int copies = copies_s.empty()? 1 : stoi(copies_s);
+    optional<int> y;
+    if(!year.empty()) y = stoi(year);
+    save_book(BookInput{bid, isbn, title, author, publisher, y, rack, copies, loan_class(cls)});
+    cout << "Book added/updated.\n";
+}
+
+static void update_book(){
+    cout << "\n--- Update Book ---\n";
+    string bid = read_nonempty("Book ID: ");
+    ShardScope shard(book_shard(bid));
+    auto rows = query_sql("SELECT book_id,title,author,total_copies,available_copies FROM books WHERE book_id=?;", bid);
+    if(rows.empty()){ cout << "Book not found.\n"; return; }
+    auto &r = rows[0];
+    cout << "Current Title: " << r[1] << " Author: " << r[2] << " Total: " << r[3] << " Avail: " << r[4] << "\n";
+    string title = prompt("New Title (leave blank): ");
+    string author = prompt("New Author (leave blank): ");
+    string copies_txt = prompt("New total copies (leave blank): ");
+    // blank fields bind NULL and keep the current value
+    optional<string> new_title, new_author;
+    optional<int> copies;
+    if(!title.empty()) new_title = title;
+    if(!author.empty()) new_author = author;
+    int diff = 0;
+    if(!copies_txt.empty()){
+        copies = stoi(copies_txt);
+        // adjust available by difference
+        int old_total = stoi(r[3]);
+        diff = *copies - old_total;
+    }
+    if(new_title || new_author || copies){
+        exec_sql("UPDATE books SET title=COALESCE(?,title), author=COALESCE(?,author), total_copies=COALESCE(?,total_copies), available_copies = available_copies + ? WHERE book_id=?;",
+            new_title, new_author, copies, diff, bid);
+        refresh_cached_book(bid);
+        if(new_title || new_author) FUZZY.invalidate();
+        cout << "Updated.\n";
+    } else cout << "Nothing changed.\n";
+}
+
+static void remove_book(){
+    cout << "\n--- Remove Book ---\n";
+    string bid = read_nonempty("Book ID: ");
+    ShardScope shard(book_shard(bid));
+    auto rows = query_sql("SELECT total_copies,available_copies FROM books WHERE book_id=?;", bid);
+    if(rows.empty()){ cout << "Book not found.\n"; return; }
+    int total = stoi(rows[0][0]), avail = stoi(rows[0][1]);
+    if(total != avail){ cout << "Cannot remove: some copies are borrowed.\n"; return; }
+    exec_sql("DELETE FROM books WHERE book_id=?;", bid);
+    CATALOG.erase(bid);
+    FUZZY.invalidate();
+    cout << "Removed.\n";
+}
+
+static void add_staff(){
+    cout << "\n--- Add Staff ---\n";
+    string sid = read_nonempty("Staff ID: ");
+    string name = read_nonempty("Name: ");
+    string pwd = prompt("Password: ");
+    exec_sql("INSERT OR REPLACE INTO users (id,name,password,role,category) VALUES (?,?,?," SQL_STAFF ", NULL);", sid, name, pwd);
+    cout << "Staff added.\n";
+}
+
+// Rows of (id, name, role, category) after id `after`; with a role filter
+// the range is on idx_users_role_id instead of the primary key.
+template<class Fn>
+static bool page_users(const ListFilter &f, const string &after, int limit, string &next, Fn &&fn){
+    if(!f.role)
+        return for_each_page("SELECT id,name,role,category FROM users WHERE id > ? ORDER BY id LIMIT ?;", limit, next, fn, after);
+    return for_each_page("SELECT id,name,role,category FROM users WHERE role=? AND id > ? ORDER BY id LIMIT ?;", limit, next, fn, (int)*f.role, after);
+}
+
+static const vector<Column> USER_COLUMNS = {{"ID", 12}, {"Name", 24, ColKind::Text, true}, {"Role", 8, ColKind::Code, false, ROLE_NAMES},
+                                            {"Category", 0, ColKind::Code, false, CATEGORY_NAMES}};
+
+static void list_users(){
+    ListFilter f;
+    while(true){
+        string role = prompt("Role (admin/staff/member, blank = all): ");
+        int i = name_index(ROLE_NAMES, role);
+        if(i >= 0) f.role = (Role)i;
+        if(i >= 0 || role.empty()) break;
+        cout << "Invalid role\n";
+    }
+    cout << "\nUsers:\n";
+    browse_pages([&](const string &after, string &next){
+        RowWriter w(OutFormat::Table, USER_COLUMNS);
+        return page_users(f, after, PAGE_SIZE, next, [&](const Row &r){ w.row(r); });
+    });
+}
+
+// -------------------- Staff functions --------------------
+static void add_member(){
+    cout << "\n--- Add Member ---\n";
+    string mid = read_nonempty("Member ID: ");
+    string name = read_nonempty("Name: ");
+    int category;
+    while(true){
+        string c = prompt("Category (student/faculty/staff): ");
+        for(auto &ch: c) ch = tolower(ch);
+        if((category = name_index(CATEGORY_NAMES, c)) >= 0) break;
+        cout << "Invalid category\n";
+    }
+    string pwd = prompt("Password: ");
+    exec_sql("INSERT OR REPLACE INTO users (id,name,password,role,category) VALUES (?,?,?," SQL_MEMBER ",?);", mid, name, pwd, category);
+    cout << "Member added.\n";
+}
+
+static const vector<Column> MEMBER_COLUMNS = {{"ID", 12}, {"Name", 24, ColKind::Text, true}, {"Role", -1},
+                                              {"Category", 0, ColKind::Code, false, CATEGORY_NAMES}};
+
+static void list_members(){
+    ListFilter f;
+    f.role = Role::Member;
+    cout << "\nMembers:\n";
+    browse_pages([&](const string &after, string &next){
+        RowWriter w(OutFormat::Table, MEMBER_COLUMNS);
+        return page_users(f, after, PAGE_SIZE, next, [&](const Row &r){ w.row(r); });
+    });
+}
+
+// -- Circulation core: validation and writes, no terminal I/O. The menus and
+// batch mode both go through these.
+enum class Status { Ok, NoMember, NoBook, NoTxn, Unavailable, Available, LimitReached, AlreadyReturned, AlreadyReserved, NoReservation, MixedBranches };
+
+static const char *status_text(Status s){
+    switch(s){
+        case Status::Ok: return "ok";
+        case Status::NoMember: return "member not found";
+        case Status::NoBook: return "book not found";
+        case Status::NoTxn: return "transaction not found";
+        case Status::Unavailable: return "no copies available";
+        case Status::Available: return "book is available";
+        case Status::LimitReached: return "borrow limit reached";
+        case Status::AlreadyReturned: return "already returned";
+        case Status::AlreadyReserved: return "already reserved";
+        case Status::NoReservation: return "no waiting reservation";
+        case Status::MixedBranches: return "items belong to different branches";
+    }
+    return "unknown";
+}
+
+// Txn ids are 64-bit integers: Unix milliseconds << 22 | a sequence, so they
+// sort by issue time and need no string building. Loans are only recorded
+// inside a write transaction, which serializes threads and processes alike;
+// bumping past the table's current MAX (one seek on the rowid B-tree) then
+// makes collisions impossible, however many issues land in one millisecond.
+// The low SHARD_TAG_BITS of the sequence are the shard, so branches that
+// pick ids independently never hand out the same one.
+using TxnId = long long;
+const int TXN_SEQ_BITS = 22;
+const int SHARD_TAG_BITS = 4;
+static_assert(MAX_SHARDS <= 1 << SHARD_TAG_BITS, "shard tag");
+
+static TxnId next_txn_id(){
+    TxnId id = chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count() << TXN_SEQ_BITS;
+    sqlite3_stmt *stmt = bound_stmt("SELECT MAX(txn_id) FROM transactions;");
+    StmtReset guard{stmt};
+    if(sqlite3_step(stmt) == SQLITE_ROW) id = max(id, (TxnId)sqlite3_column_int64(stmt, 0) + 1);
+    return id + ((CUR_SHARD - id) & ((1 << SHARD_TAG_BITS) - 1));
+}
+
+// Accepts the numeric id, or a legacy "TX<ms>" receipt from before
+// migration 6.
+static bool parse_txn_id(string_view s, TxnId &out){
+    while(!s.empty() && isspace((unsigned char)s.front())) s.remove_prefix(1);
+    while(!s.empty() && isspace((unsigned char)s.back())) s.remove_suffix(1);
+    bool legacy = s.size() > 2 && s[0] == 'T' && s[1] == 'X';
+    if(legacy) s.remove_prefix(2);
+    auto res = from_chars(s.data(), s.data() + s.size(), out);
+    if(res.ec != errc() || res.ptr != s.data() + s.size() || out <= 0) return false;
+    if(legacy) out <<= TXN_SEQ_BITS;
+    return true;
+}
+
+struct IssueResult {
+    Status status = Status::Ok;
+    TxnId txn = 0;
+    EpochSecs due = 0;
+    int limit = 0;
+};
+
+struct ReturnResult {
+    Status status = Status::Ok;
+    int fine = 0;
+    // set when a waiting reservation was auto-issued
+    string next_member;
+    TxnId next_txn = 0;
+};
+
+// Takes a copy and inserts the loan row, due per rule; Unavailable, with
+// nothing written, when no copy is left. The caller owns the transaction.
+// Its statistics follow through the write-behind. txn is the id to use, 0
+// to pick the next one.
+static IssueResult record_loan(const string &mid, const string &bid, MemberCategory cat, const LoanRule &rule, TxnId txn = 0){
+    IssueResult res;
+    exec_sql("UPDATE books SET available_copies = available_copies - 1 WHERE book_id=? AND available_copies > 0;", bid);
+    if(changes() == 0){ res.status = Status::Unavailable; return res; }
+    queue_copies(bid, -1);
+    EpochSecs issue = now_epoch();
+    res.due = issue + rule.loan_days * SECS_PER_DAY;
+    res.txn = txn? txn : next_txn_id();
+    exec_sql("INSERT INTO transactions (txn_id,member_id,book_id,issue_date,due_date,status) VALUES (?,?,?,?,?," SQL_BORROWED ");", res.txn, mid, bid, issue, res.due);
+    queue_stats(StatDelta{bid, CATEGORY_NAMES[(int)cat], epoch_day(issue), 1, 0, 0});
+    return res;
+}
+
+// Counters that disagree with the transactions/reservations they
+// summarize, by column; rebuild_counters() sets them back.
+struct CounterCheck {
+    int active_loans = 0, available = 0, borrowed = 0, holds = 0;
+    int total() const { return active_loans + available + borrowed + holds; }
+};
+
+// Recomputes every materialized counter from the source rows in one
+// transaction per shard. borrowed_count is a lifetime total, so it is only
+// raised to the loan history, never lowered (imports may carry older counts).
+static CounterCheck rebuild_shard_counters(){
+    Transaction tx;
+    CounterCheck c;
+    exec_sql("UPDATE users SET active_loans = (SELECT COUNT(*) FROM transactions t WHERE t.member_id=users.id AND t.status=" SQL_BORROWED ") "
+             "WHERE active_loans <> (SELECT COUNT(*) FROM transactions t WHERE t.member_id=users.id AND t.status=" SQL_BORROWED ");");
+    c.active_loans = changes();
+    exec_sql("UPDATE books SET available_copies = MAX(0, total_copies - (SELECT COUNT(*) FROM transactions t WHERE t.book_id=books.book_id AND t.status=" SQL_BORROWED ")) "
+             "WHERE available_copies <> MAX(0, total_copies - (SELECT COUNT(*) FROM transactions t WHERE t.book_id=books.book_id AND t.status=" SQL_BORROWED "));");
+    c.available = changes();
+    exec_sql("UPDATE books SET borrowed_count = (SELECT COUNT(*) FROM transactions t WHERE t.book_id=books.book_id) "
+             "WHERE borrowed_count < (SELECT COUNT(*) FROM transactions t WHERE t.book_id=books.book_id);");
+    c.borrowed = changes();
+    exec_sql("UPDATE books SET waiting_holds = (SELECT COUNT(*) FROM reservations r WHERE r.book_id=books.book_id AND r.status=" SQL_WAITING ") "
+             "WHERE waiting_holds <> (SELECT COUNT(*) FROM reservations r WHERE r.book_id=books.book_id AND r.status=" SQL_WAITING ");");
+    c.holds = changes();
+    tx.commit();
+    if(c.available || c.borrowed) CATALOG.clear();
+    return c;
+}
+
+static CounterCheck rebuild_counters(){
+    flush_stats();
+    CounterCheck total;
+    for(int s = 0; s < shard_count(); ++s){
+        ShardScope shard(s);
+        CounterCheck c = rebuild_shard_counters();
+        total.active_loans += c.active_loans;
+        total.available += c.available;
+        total.borrowed += c.borrowed;
+        total.holds += c.holds;
+    }
+    return total;
+}
+
+// -- Branch routing (see Branch shards): the entry points below switch to
+// the shard of the book or loan they act on; member-wide ones visit all.
+
+// Open loans member mid holds in shards other than the current one.
+static int loans_elsewhere(const string &mid){
+    if(shard_count() == 1) return 0;
+    int n = 0, here = CUR_SHARD;
+    for_each_gathered("SELECT {i} AS shard, active_loans FROM {s}.users WHERE id=?1", "SELECT * FROM {all}", [&](const Row &r){
+        if(r.integer(0) != here) n += r.integer(1);
+    }, mid);
+    return n;
+}
+
+// Brings the current branch's copy of member mid up to date from shard 0
+// (logins stay there, so the copy has no password); false if there is no
+// such member. Runs in the caller's transaction; nothing to do on shard 0.
+static bool copy_member(const string &mid){
+    if(CUR_SHARD == 0) return true;
+    optional<pair<string, optional<int>>> member;
+    {
+        ShardScope home(0);
+        for_each_row("SELECT name,category FROM users WHERE id=? AND role=" SQL_MEMBER ";", [&](const Row &r){
+            member.emplace(string(r.text(0)), r.is_null(1)? nullopt : optional<int>(r.integer(1)));
+        }, mid);
+    }
+    if(!member) return false;
+    exec_sql("INSERT INTO users (id,name,password,role,category) VALUES (?1,?2,''," SQL_MEMBER ",?3) "
+             "ON CONFLICT(id) DO UPDATE SET name=excluded.name, category=excluded.category "
+             "WHERE (name, category) IS NOT (excluded.name, excluded.category);", mid, member->first, member->second);
+    return true;
+}
+
+// -- Reservation queue: one FIFO per book, ordered by res_id on
+// idx_res_queue, so the head (and each hold behind it) is an index seek.
+const int HOLD_SCAN_LIMIT = 16;
+const int DEFAULT_HOLD_EXPIRY_DAYS = 30;
+
+// Hands a returned copy to the first waiting member who may still borrow;
+// members at their limit keep their place for the next copy, holds of
+// deleted members are cancelled. Runs in the caller's return transaction.
+static bool fulfill_next_hold(const string &bid, LoanClass cls, string &member, TxnId &txn){
+    auto heads = query_sql("SELECT r.res_id,r.member_id,u.id,COALESCE(u.category,0),u.active_loans FROM reservations r "
+                           "LEFT JOIN users u ON u.id=r.member_id AND u.role=" SQL_MEMBER " "
+                           "WHERE r.book_id=? AND r.status=" SQL_WAITING " ORDER BY r.res_id LIMIT ?;", bid, HOLD_SCAN_LIMIT);
+    for(auto &h: heads){
+        if(h[2].empty()){
+            exec_sql("UPDATE reservations SET status=" SQL_CANCELLED " WHERE res_id=?;", h[0]);
+            continue;
+        }
+        MemberCategory cat = member_category(stoi(h[3]));
+        const LoanRule &rule = loan_rule(cat, cls);
+        if(stoi(h[4]) + loans_elsewhere(h[1]) >= rule.max_loans) continue;
+        auto loan = record_loan(h[1], bid, cat, rule);
+        if(loan.status != Status::Ok) return false;
+        exec_sql("UPDATE reservations SET status=" SQL_FULFILLED " WHERE res_id=?;", h[0]);
+        member = h[1];
+        txn = loan.txn;
+        return true;
+    }
+    return false;
+}
+
+static Status cancel_hold(const string &mid, const string &bid){
+    ShardScope shard(book_shard(bid));
+    exec_sql("UPDATE reservations SET status=" SQL_CANCELLED " WHERE book_id=? AND member_id=? AND status=" SQL_WAITING ";", bid, mid);
+    return changes() > 0? Status::Ok : Status::NoReservation;
+}
+
+static int cancel_member_holds(const string &mid){
+    int n = 0;
+    for(int s = 0; s < shard_count(); ++s){
+        ShardScope shard(s);
+        exec_sql("UPDATE reservations SET status=" SQL_CANCELLED " WHERE member_id=? AND status=" SQL_WAITING ";", mid);
+        n += changes();
+    }
+    return n;
+}
+
+// Expires every hold that has waited longer than days; returns how many.
+static int expire_holds(int days){
+    int n = 0;
+    for(int s = 0; s < shard_count(); ++s){
+        ShardScope shard(s);
+        exec_sql("UPDATE reservations SET status=" SQL_EXPIRED " WHERE status=" SQL_WAITING " AND res_date < ?;", now_epoch() - days * SECS_PER_DAY);
+        n += changes();
+    }
+    return n;
+}
+
+// 1-based place in the book's queue, 0 if the member isn't waiting.
+static int hold_position(const string &mid, const string &bid){
+    ShardScope shard(book_shard(bid));
+    auto rows = query_sql("SELECT COUNT(*) FROM reservations q, reservations me "
+                          "WHERE me.book_id=?1 AND me.member_id=?2 AND me.status=" SQL_WAITING " "
+                          "AND q.book_id=?1 AND q.status=" SQL_WAITING " AND q.res_id <= me.res_id;", bid, mid);
+    return rows.empty()? 0 : stoi(rows[0][0]);
+}
+
+static IssueResult issue_book_core(const string &mid, const string &bid){
+    ShardScope shard(book_shard(bid));
+    // the limit counts loans at every branch; those elsewhere are read
+    // outside this shard's lock, so concurrent issues at two branches can
+    // overshoot it by one
+    int elsewhere = loans_elsewhere(mid);
+    // lookups, limit check and writes commit (or roll back) together
+    Transaction tx;
+    IssueResult res;
+    if(!copy_member(mid)){ res.status = Status::NoMember; return res; }
+    auto mrows = query_sql("SELECT id,COALESCE(category,0),active_loans FROM users WHERE id=? AND role=" SQL_MEMBER ";", mid);
+    if(mrows.empty()){ res.status = Status::NoMember; return res; }
+    MemberCategory cat = member_category(stoi(mrows[0][1]));
+    // the book row, not the Catalog cache: other processes and rolled back
+    // batch groups change copies without it
+    auto brows = query_sql("SELECT available_copies,loan_class FROM books WHERE book_id=?;", bid);
+    if(brows.empty()){ res.status = Status::NoBook; return res; }
+    if(stoi(brows[0][0]) < 1){ res.status = Status::Unavailable; return res; }
+
+    // borrow limit
+    const LoanRule &rule = loan_rule(cat, loan_class(brows[0][1]));
+    if(stoi(mrows[0][2]) + elsewhere >= rule.max_loans){ res.status = Status::LimitReached; res.limit = rule.max_loans; return res; }
+
+    res = record_loan(mid, bid, cat, rule);
+    if(res.status != Status::Ok) return res;
+    tx.commit();
+    return res;
+}
+
+// The loan columns close_loan() reads.
+#define RETURN_COLUMNS "SELECT txn_id,member_id,book_id,issue_date,due_date,return_date,status," \
+    "(SELECT COALESCE(category,0) FROM users WHERE id=member_id),(SELECT loan_class FROM books b WHERE b.book_id=t.book_id) " \
+    "FROM transactions t "
+
+// Returns the loan in r (a RETURN_COLUMNS row): fine, copy back, and the
+// copy handed on to the next hold if any. Runs in the caller's transaction.
+static ReturnResult close_loan(const vector<string> &r){
+    ReturnResult res;
+    TxnId txn = stoll(r[0]);
+    if(stoi(r[6]) == (int)LoanStatus::Returned){ res.status = Status::AlreadyReturned; return res; }
+    // compute fine from whole days past the due date
+    EpochSecs due = stoll(r[4]);
+    EpochSecs ret = now_epoch();
+    long long overdue = epoch_day(ret) - epoch_day(due);
+    LoanClass cls = loan_class(r[8]);
+    MemberCategory cat = member_category(r[7].empty()? -1 : stoi(r[7]));
+    res.fine = loan_fine(loan_rule(cat, cls), overdue);
+    // update transaction
+    exec_sql("UPDATE transactions SET return_date=?, fine=?, status=" SQL_RETURNED " WHERE txn_id=?;", ret, res.fine, txn);
+    queue_stats(StatDelta{"", CATEGORY_NAMES[(int)cat], epoch_day(ret), 0, 1, res.fine});
+    // free book
+    string bid = r[2];
+    exec_sql("UPDATE books SET available_copies = available_copies + 1 WHERE book_id=?;", bid);
+    queue_copies(bid, +1);
+
+    // auto-issue to the head of the reservation queue
+    fulfill_next_hold(bid, cls, res.next_member, res.next_txn);
+    return res;
+}
+
+static ReturnResult return_book_core(TxnId txn){
+    ShardScope shard(txn_shard(txn));
+    // the return and any reservation auto-issue are one atomic unit
+    Transaction tx;
+    auto rows = query_sql(RETURN_COLUMNS "WHERE txn_id=?;", txn);
+    if(rows.empty()){ ReturnResult res; res.status = Status::NoTxn; return res; }
+    ReturnResult res = close_loan(rows[0]);
+    if(res.status != Status::Ok) return res;
+    tx.commit();
+    return res;
+}
+
+// A member of any branch queues in the shard of the book's branch, so the
+// hold is served by returns there.
+static Status reserve_book_core(const string &mid, const string &bid){
+    ShardScope shard(book_shard(bid));
+    Transaction tx;
+    auto brows = query_sql("SELECT available_copies FROM books WHERE book_id=?;", bid);
+    if(brows.empty()) return Status::NoBook;
+    if(stoi(brows[0][0]) > 0) return Status::Available;
+    if(!copy_member(mid) || query_sql("SELECT 1 FROM users WHERE id=? AND role=" SQL_MEMBER ";", mid).empty()) return Status::NoMember;
+    // idx_res_one_per_member makes a second waiting hold a no-op
+    exec_sql("INSERT OR IGNORE INTO reservations (book_id,member_id,res_date,status) VALUES (?,?,?," SQL_WAITING ");", bid, mid, now_epoch());
+    if(changes() == 0) return Status::AlreadyReserved;
+    tx.commit();
+    return Status::Ok;
+}
+
+// -- Desk stacks: a pile of books issued to one member, or a pile of loans
+// returned, in one transaction that commits or fails as a whole. The
+// member and the limit are checked once, and the books (or loans) are read
+// with one IN query over a JSON array parameter, which keeps the SQL text
+// fixed for STMT_CACHE. A stack must sit in one branch's shard.
+struct StackIssueResult {
+    Status status = Status::Ok;
+    string failed;              // book that stopped the stack
+    int limit = 0;
+    vector<IssueResult> loans;  // in the order given
+};
+
+struct StackReturnResult {
+    Status status = Status::Ok;
+    string failed;              // txn that stopped the stack
+    vector<ReturnResult> returns;
+};
+
+static string json_ids(const vector<string> &ids){
+    string s = "[";
+    for(size_t i = 0; i < ids.size(); ++i){
+        if(i) s += ',';
+        json_string(s, ids[i]);
+    }
+    return s + "]";
+}
+
+static string json_ids(const vector<TxnId> &ids){
+    string s = "[";
+    for(size_t i = 0; i < ids.size(); ++i){
+        if(i) s += ',';
+        s += to_string(ids[i]);
+    }
+    return s + "]";
+}
+
+// Shard holding all of the stack, given an arm yielding (shard, id) for
+// the ids in ?1; -1 with the odd one out in failed when they span shards.
+// Ids found nowhere are left for the lookup in the chosen shard to report.
+static int stack_shard(const char *arm, const string &ids, string &failed){
+    if(shard_count() == 1) return 0;
+    int s = -1;
+    for_each_gathered(arm, "SELECT * FROM {all}", [&](const Row &r){
+        if(s == -2) return;
+        if(s == -1) s = r.integer(0);
+        else if(r.integer(0) != s){ s = -2; failed.assign(r.text(1)); }
+    }, ids);
+    return s == -2? -1 : max(s, 0);
+}
+
+static StackIssueResult issue_books_core(const string &mid, const vector<string> &bids){
+    StackIssueResult res;
+    string ids = json_ids(bids);
+    int s = stack_shard("SELECT {i} AS shard, book_id FROM {s}.books WHERE book_id IN (SELECT value FROM json_each(?1))", ids, res.failed);
+    if(s < 0){ res.status = Status::MixedBranches; return res; }
+    ShardScope shard(s);
+    int held = loans_elsewhere(mid);
+    Transaction tx;
+    if(!copy_member(mid)){ res.status = Status::NoMember; return res; }
+    auto mrows = query_sql("SELECT id,COALESCE(category,0),active_loans FROM users WHERE id=? AND role=" SQL_MEMBER ";", mid);
+    if(mrows.empty()){ res.status = Status::NoMember; return res; }
+    MemberCategory cat = member_category(stoi(mrows[0][1]));
+    held += stoi(mrows[0][2]);
+    // copies left and class of every book in the stack, under the write lock
+    unordered_map<string, pair<int, LoanClass>> books;
+    for_each_row("SELECT book_id,available_copies,loan_class FROM books WHERE book_id IN (SELECT value FROM json_each(?));", [&](const Row &r){
+        books.emplace(string(r.text(0)), make_pair(r.integer(1), loan_class(r.text(2))));
+    }, ids);
+    vector<const LoanRule*> rules;
+    for(auto &bid: bids){
+        auto it = books.find(bid);
+        res.failed = bid;
+        if(it == books.end()){ res.status = Status::NoBook; return res; }
+        // a book listed twice takes two copies
+        if(it->second.first-- < 1){ res.status = Status::Unavailable; return res; }
+        const LoanRule &rule = loan_rule(cat, it->second.second);
+        if(held++ >= rule.max_loans){ res.status = Status::LimitReached; res.limit = rule.max_loans; return res; }
+        rules.push_back(&rule);
+    }
+    res.failed.clear();
+    // ids after the first keep its shard tag and stay above the table's MAX
+    TxnId txn = next_txn_id();
+    for(size_t i = 0; i < bids.size(); ++i, txn += 1 << SHARD_TAG_BITS){
+        res.loans.push_back(record_loan(mid, bids[i], cat, *rules[i], txn));
+        if(res.loans.back().status != Status::Ok){ res.status = Status::Unavailable; res.failed = bids[i]; res.loans.clear(); return res; }
+    }
+    tx.commit();
+    return res;
+}
+
+static StackReturnResult return_books_core(const vector<TxnId> &txns){
+    StackReturnResult res;
+    string ids = json_ids(txns);
+    int s = stack_shard("SELECT {i} AS shard, txn_id FROM {s}.transactions WHERE txn_id IN (SELECT value FROM json_each(?1))", ids, res.failed);
+    if(s < 0){ res.status = Status::MixedBranches; return res; }
+    ShardScope shard(s);
+    Transaction tx;
+    unordered_map<TxnId, vector<string>> loans;
+    for(auto &r: query_sql(RETURN_COLUMNS "WHERE txn_id IN (SELECT value FROM json_each(?));", ids)) loans.emplace(stoll(r[0]), move(r));
+    for(TxnId txn: txns){
+        auto it = loans.find(txn);
+        res.failed = to_string(txn);
+        if(it == loans.end()){ res.status = Status::NoTxn; return res; }
+        ReturnResult one = close_loan(it->second);
+        if(one.status != Status::Ok){ res.status = one.status; return res; }
+        // a txn listed twice reads as returned the second time
+        it->second[6] = to_string((int)LoanStatus::Returned);
+        res.returns.push_back(move(one));
+    }
+    res.failed.clear();
+    tx.commit();
+    return res;
+}
+
+static vector<string> read_words(const string &prompt){
+    istringstream in(read_nonempty(prompt));
+    vector<string> words;
+    for(string w; in >> w;) words.push_back(w);
+    return words;
+}
+
+static void issue_stack(const string &mid, const vector<string> &bids){
+    auto res = issue_books_core(mid, bids);
+    if(res.status != Status::Ok){
+        cout << "Nothing issued: " << (res.failed.empty()? "" : res.failed + ": ") << status_text(res.status);
+        if(res.status == Status::LimitReached) cout << " (" << res.limit << ")";
+        cout << "\n";
+        return;
+    }
+    cout << "Issued " << res.loans.size() << " books.\n";
+    for(size_t i = 0; i < res.loans.size(); ++i)
+        cout << "  " << bids[i] << " TxnID=" << res.loans[i].txn << " Due: " << date_text(res.loans[i].due) << "\n";
+}
+
+static void issue_book(){
+    cout << "\n--- Issue Book ---\n";
+    string mid = read_nonempty("Member ID: ");
+    auto bids = read_words("Book ID(s): ");
+    if(bids.size() > 1){ issue_stack(mid, bids); return; }
+    auto res = issue_book_core(mid, bids[0]);
+    switch(res.status){
+        case Status::Ok: cout << "Issued. TxnID=" << res.txn << " Due: " << date_text(res.due) << "\n"; break;
+        case Status::NoMember: cout << "Member not found.\n"; break;
+        case Status::NoBook: cout << "Book not found.\n"; break;
+        case Status::Unavailable: cout << "No copies available. Consider reserving.\n"; break;
+        case Status::LimitReached: cout << "Borrow limit reached (" << res.limit << ")\n"; break;
+        default: cout << status_text(res.status) << "\n";
+    }
+}
+
+static void print_return_result(const ReturnResult &res){
+    switch(res.status){
+        case Status::Ok:
+            cout << "Book returned. Fine: ₹" << res.fine << "\n";
+            if(res.next_txn != 0) cout << "Reservation fulfilled: issued to " << res.next_member << " Txn " << res.next_txn << "\n";
+            break;
+        case Status::NoTxn: cout << "Transaction not found.\n"; break;
+        case Status::AlreadyReturned: cout << "Already returned.\n"; break;
+        default: cout << status_text(res.status) << "\n";
+    }
+}
+
+static void return_book(){
+    cout << "\n--- Return Book ---\n";
+    auto words = read_words("Transaction ID(s): ");
+    vector<TxnId> txns(words.size());
+    for(size_t i = 0; i < words.size(); ++i)
+        if(!parse_txn_id(words[i], txns[i])){ cout << "Invalid transaction ID: " << words[i] << "\n"; return; }
+    if(txns.size() == 1){ print_return_result(return_book_core(txns[0])); return; }
+    auto res = return_books_core(txns);
+    if(res.status != Status::Ok){ cout << "Nothing returned: " << res.failed << ": " << status_text(res.status) << "\n"; return; }
+    int total = 0;
+    for(size_t i = 0; i < txns.size(); ++i){
+        auto &r = res.returns[i];
+        total += r.fine;
+        cout << "  " << txns[i] << " returned. Fine: ₹" << r.fine << "\n";
+        if(r.next_txn != 0) cout << "    Reservation fulfilled: issued to " << r.next_member << " Txn " << r.next_txn << "\n";
+    }
+    cout << "Returned " << txns.size() << " books. Total fine: ₹" << total << "\n";
+}
+
+static void reserve_book(){
+    cout << "\n--- Reserve Book ---\n";
+    string mid = read_nonempty("Member ID: ");
+    string bid = read_nonempty("Book ID: ");
+    switch(reserve_book_core(mid, bid)){
+        case Status::Ok: cout << "Reserved (FIFO, position " << hold_position(mid, bid) << "). You'll be allocated when a copy is returned.\n"; break;
+        case Status::NoBook: cout << "Book not found.\n"; break;
+        case Status::NoMember: cout << "Member not found.\n"; break;
+        case Status::Available: cout << "Book is available now; borrow instead.\n"; break;
+        case Status::AlreadyReserved: cout << "Member already has a waiting reservation for this book.\n"; break;
+        default: break;
+    }
+}
+
+static void manage_reservations(){
+    cout << "Reservations: 1) Cancel 2) Cancel all for member 3) Expire old holds 4) Queue for book 0) Back\n";
+    string r = prompt("Choice: ");
+    if(r=="1"){
+        string mid = read_nonempty("Member ID: ");
+        string bid = read_nonempty("Book ID: ");
+        cout << (cancel_hold(mid, bid) == Status::Ok? "Cancelled.\n" : "No waiting reservation.\n");
+    } else if(r=="2"){
+        string mid = read_nonempty("Member ID: ");
+        cout << "Cancelled " << cancel_member_holds(mid) << " reservation(s).\n";
+    } else if(r=="3"){
+        string d = prompt("Older than days (default " + to_string(DEFAULT_HOLD_EXPIRY_DAYS) + "): ");
+        int days = d.empty()? DEFAULT_HOLD_EXPIRY_DAYS : stoi(d);
+        cout << "Expired " << expire_holds(days) << " reservation(s).\n";
+    } else if(r=="4"){
+        string bid = read_nonempty("Book ID: ");
+        ShardScope shard(book_shard(bid));
+        int pos = 0;
+        for_each_row("SELECT member_id,res_date FROM reservations WHERE book_id=? AND status=" SQL_WAITING " ORDER BY res_id;", [&](const Row &q){
+            cout << ++pos << ". " << q.text(0) << " since " << date_text(q.int64(1)) << "\n";
+        }, bid);
+        if(pos == 0) cout << "No one waiting.\n";
+    }
+}
+
+// Rows of (txn_id, member_id, book_id, issue_date, due_date) for open
+// loans after txn id `after`: idx_txn_open, or idx_txn_member_status (whose
+// entries end in the rowid, i.e. txn_id) for one member.
+template<class Fn>
+static bool page_borrowed(const ListFilter &f, const string &after, int limit, string &next, Fn &&fn){
+    TxnId from = 0;
+    if(!after.empty() && !parse_txn_id(after, from)) return false;
+    EpochSecs due_before = f.overdue_only? epoch_day(now_epoch()) * SECS_PER_DAY : numeric_limits<EpochSecs>::max();
+    ShardScope gather(gather_conn());
+    if(f.member.empty())
+        // the planner prefers walking the rowid, which degrades as returned
+        // loans pile up; the partial index holds only open loans
+        return for_each_page(gather_sql("SELECT txn_id,member_id,book_id,issue_date,due_date FROM {s}.transactions INDEXED BY idx_txn_open "
+                                        "WHERE status=" SQL_BORROWED " AND txn_id > ?1 AND due_date < ?2 ORDER BY txn_id LIMIT ?3",
+                                        "SELECT * FROM {all} ORDER BY txn_id LIMIT ?3"), limit, next, fn, from, due_before);
+    return for_each_page(gather_sql("SELECT txn_id,member_id,book_id,issue_date,due_date FROM {s}.transactions "
+                                    "WHERE member_id=?1 AND status=" SQL_BORROWED " AND txn_id > ?2 AND due_date < ?3 ORDER BY txn_id LIMIT ?4",
+                                    "SELECT * FROM {all} ORDER BY txn_id LIMIT ?4"), limit, next, fn, f.member, from, due_before);
+}
+
+static const vector<Column> LOAN_COLUMNS = {
+    {"Txn", 21, ColKind::Id}, {"Member", 12}, {"Book", 10}, {"Issued", 12, ColKind::Date}, {"Due", 0, ColKind::Date}};
+
+static void list_borrowed(){
+    ListFilter f;
+    f.member = prompt("Member ID (blank = all): ");
+    f.overdue_only = yes(prompt("Only overdue? (y/N): "));
+    cout << "\nCurrently Borrowed:\n";
+    browse_pages([&](const string &after, string &next){
+        RowWriter w(OutFormat::Table, LOAN_COLUMNS);
+        return page_borrowed(f, after, PAGE_SIZE, next, [&](const Row &r){ w.row(r); });
+    });
+}
+
+// -------------------- Member functions --------------------
+// Turns free text into an FTS5 query: every word becomes a quoted prefix
+// term, so "clean co" matches "Clean Code" and punctuation can't inject
+// FTS operators.
+static string fts_prefix_query(const string &q){
+    string out, word;
+    auto flush = [&](){
+        if(word.empty()) return;
+        if(!out.empty()) out += ' ';
+        out += '"' + word + "\"*";
+        word.clear();
+    };
+    for(char c: q){
+        if(isalnum((unsigned char)c) || (unsigned char)c >= 0x80) word.push_back(c);
+        else flush();
+    }
+    flush();
+    return out;
+}
+
+static bool looks_like_isbn(const string &q){
+    string digits;
+    for(char c: q){
+        if(isdigit((unsigned char)c) || c=='X' || c=='x') digits.push_back(c);
+        else if(c!='-' && c!=' ') return false;
+    }
+    return digits.size()==10 || digits.size()==13;
+}
+
+// Lowercase words of q, split as fts_prefix_query() splits them.
+static vector<string> query_words(const string &q){
+    vector<string> words(1);
+    for(char c: q){
+        if(isalnum((unsigned char)c) || (unsigned char)c >= 0x80) words.back().push_back((char)tolower((unsigned char)c));
+        else if(!words.back().empty()) words.emplace_back();
+    }
+    if(words.back().empty()) words.pop_back();
+    return words;
+}
+
+const int FUZZY_CANDIDATES = 200;           // bm25-best books re-ranked by typos
+const int FUZZY_RESULTS = 50;
+
+// find_books() for queries with no exact hits: each word matches its own
+// prefix or one of its FuzzyIndex corrections in title or author, and the
+// best bm25 candidates are re-ranked by total typos. Words with neither
+// are dropped. Returns whether anything was searched.
+template<class Fn>
+static bool fuzzy_find_books(const string &q, Fn &&fn){
+    struct Word {
+        string text;
+        bool prefix;
+        vector<FuzzyMatch> corrections;
+    };
+    vector<Word> words;
+    string match;
+    for(auto &w: query_words(q)){
+        Word word{w, false, {}};
+        word.prefix = FUZZY.lookup(w, word.corrections);
+        if(!word.prefix && word.corrections.empty()) continue;
+        match += match.empty()? "{title author} : (" : " AND {title author} : (";
+        bool first = true;
+        if(word.prefix){ match += '"' + w + "\"*"; first = false; }
+        for(auto &c: word.corrections){ match += (first? "\"" : " OR \"") + c.term + '"'; first = false; }
+        match += ')';
+        words.push_back(move(word));
+    }
+    if(match.empty()) return false;
+
+    struct Candidate {
+        string book_id;
+        int typos;
+    };
+    vector<Candidate> found;
+    for_each_gathered("SELECT b.book_id,b.title,b.author,bm25(books_fts, 10.0, 5.0, 1.0) AS rank "
+                      "FROM {s}.books_fts JOIN {s}.books b ON b.rowid=books_fts.rowid WHERE books_fts MATCH ?1 ORDER BY rank LIMIT ?2",
+                      "SELECT * FROM {all} ORDER BY rank LIMIT ?2", [&](const Row &r){
+        vector<string> tokens = query_words(string(r.text(1)) + " " + string(r.text(2)));
+        int typos = 0;
+        for(auto &w: words){
+            int best = FUZZY_MAX_WORD;
+            for(auto &t: tokens){
+                if(w.prefix && t.compare(0, w.text.size(), w.text) == 0){ best = 0; break; }
+                for(auto &c: w.corrections) if(c.term == t) best = min(best, c.typos);
+            }
+            typos += best;
+        }
+        found.push_back({string(r.text(0)), typos});
+    }, match, FUZZY_CANDIDATES);
+    stable_sort(found.begin(), found.end(), [](const Candidate &a, const Candidate &b){ return a.typos < b.typos; });
+    if(found.size() > (size_t)FUZZY_RESULTS) found.resize(FUZZY_RESULTS);
+    vector<string> ids;
+    for(auto &c: found) ids.push_back(c.book_id);
+    for_each_gathered("SELECT b.book_id,b.isbn,b.title,b.author,b.available_copies,j.key AS rank "
+                      "FROM json_each(?1) j JOIN {s}.books b ON b.book_id=j.value ORDER BY j.key",
+                      "SELECT * FROM {all} ORDER BY rank", fn, json_ids(ids));
+    return true;
+}
+
+// Streams matches as rows of (book_id,isbn,title,author,available_copies),
+// from every branch. When nothing matches exactly, streams close matches
+// instead (fuzzy_find_books()) and returns true.
+template<class Fn>
+static bool find_books(const string &q, Fn &&fn){
+    // exact ISBN goes straight to idx_books_isbn
+    if(looks_like_isbn(q)){
+        bool found = false;
+        for_each_gathered("SELECT book_id,isbn,title,author,available_copies FROM {s}.books WHERE isbn=?1", "SELECT * FROM {all}",
+            [&](const Row &r){ found = true; fn(r); }, q);
+        if(found) return false;
+    }
+    string match = fts_prefix_query(q);
+    if(match.empty()){
+        for_each_gathered("SELECT book_id,isbn,title,author,available_copies FROM {s}.books", "SELECT * FROM {all}", fn);
+        return false;
+    }
+    // bm25 ranks title hits above author hits above isbn hits; scores from
+    // different branches are merged as they are
+    bool found = false;
+    for_each_gathered("SELECT b.book_id,b.isbn,b.title,b.author,b.available_copies,bm25(books_fts, 10.0, 5.0, 1.0) AS rank "
+                      "FROM {s}.books_fts JOIN {s}.books b ON b.rowid=books_fts.rowid WHERE books_fts MATCH ?1 ORDER BY rank",
+                      "SELECT * FROM {all} ORDER BY rank", [&](const Row &r){ found = true; fn(r); }, match);
+    return !found && fuzzy_find_books(q, fn);
+}
+
+static void search_books(){
+    cout << "--- Search Books ---\n";
+    string q = prompt("Query (title/author/isbn): ");
+    cout << "\nSearch Results:\n";
+    bool fuzzy = find_books(q, [](const Row &r){
+        cout << r.text(0) << " | " << r.text(2) << " | " << r.text(3) << " | Avail:" << r.integer(4) << "\n";
+    });
+    if(fuzzy) cout << "(no exact matches; showing close matches)\n";
+}
+
+static void my_borrowed(const User &user){
+    cout << "\nMy Transactions:\n";
+    for_each_gathered("SELECT txn_id,book_id,issue_date,due_date,status,fine FROM {s}.transactions WHERE member_id=?1 ORDER BY issue_date DESC",
+                      "SELECT * FROM {all} ORDER BY issue_date DESC", [](const Row &r){
+        cout << r.text(0) << " | " << r.text(1) << " | Issue:" << date_text(r.int64(2)) << " | Due:" << date_text(r.int64(3)) << " | Status:" << LOAN_STATUS_NAMES[r.integer(4)] << " | Fine:" << r.text(5) << "\n";
+    }, user.id);
+}
+
+static void return_book_member(const User &user){
+    TxnId txn;
+    if(!parse_txn_id(read_nonempty("Txn ID to return: "), txn)){ cout << "Invalid transaction ID.\n"; return; }
+    // check ownership
+    ShardScope shard(txn_shard(txn));
+    auto rows = query_sql("SELECT txn_id FROM transactions WHERE txn_id=? AND member_id=? AND status=" SQL_BORROWED ";", txn, user.id);
+    if(rows.empty()){ cout << "No matching borrowed transaction.\n"; return; }
+    print_return_result(return_book_core(txn));
+}
+
+static void reserve_book_member(const User &user){
+    string bid = read_nonempty("Book ID to reserve: ");
+    switch(reserve_book_core(user.id, bid)){
+        case Status::Ok: cout << "Reserved (position " << hold_position(user.id, bid) << "). You'll be notified when available.\n"; break;
+        case Status::NoBook: cout << "Book not found.\n"; break;
+        case Status::Available: cout << "Book available; you can borrow it instead.\n"; break;
+        case Status::AlreadyReserved: cout << "You already have a reservation for this book.\n"; break;
+        default: break;
+    }
+}
+
+static void cancel_reservation_member(const User &user){
+    string bid = read_nonempty("Book ID to cancel: ");
+    cout << (cancel_hold(user.id, bid) == Status::Ok? "Reservation cancelled.\n" : "No waiting reservation for that book.\n");
+}
+
+// -------------------- Reports --------------------
+// Rows of (txn_id, member_id, book_id, due, days, fine).
+static const vector<Column> OVERDUE_COLUMNS = {
+    {"Txn", 21, ColKind::Id}, {"Member", 12}, {"Book", 10}, {"Due", 12, ColKind::Date}, {"Days", 6, ColKind::Int}, {"Fine", 0, ColKind::Int}};
+
+template<class Fn>
+static void for_each_overdue(Fn &&fn){
+    // overdue means due on an earlier day than today: a range scan on
+    // idx_txn_borrowed_due, with day count and fine (loan_fine, see Loan
+    // policy) computed by the engine; the member and book are only looked
+    // up when the fine rules differ by category or class
+    long long today = epoch_day(now_epoch());
+    for_each_gathered("SELECT txn_id,member_id,book_id,due_date AS due,?1 - due_date/86400 AS days,"
+                      "loan_fine(CASE WHEN ?2 THEN (SELECT category FROM {s}.users u WHERE u.id=t.member_id) END,"
+                      "CASE WHEN ?3 THEN (SELECT loan_class FROM {s}.books b WHERE b.book_id=t.book_id) END, ?1 - due_date/86400) AS fine "
+                      "FROM {s}.transactions t WHERE status=" SQL_BORROWED " AND due_date < ?1 * 86400 ORDER BY due_date",
+                      "SELECT * FROM {all} ORDER BY due", fn, today, (int)FINES_BY_CATEGORY, (int)FINES_BY_CLASS);
+}
+
+// Rows of (book_id, title, count): the first n entries of
+// idx_books_borrowed_count, so the cost follows n rather than the catalog.
+const int DEFAULT_TOP_N = 10;
+static const vector<Column> TOP_COLUMNS = {{"ID", 8}, {"Title", 40, ColKind::Text, true}, {"Count", 0, ColKind::Int}};
+const int DEFAULT_STATS_DAYS = 14;
+
+// The dashboards below read the write-behind statistics, so they flush
+// them first.
+template<class Fn>
+static void for_each_top_borrowed(Fn &&fn, int n = DEFAULT_TOP_N){
+    flush_stats();
+    for_each_gathered("SELECT book_id,title,borrowed_count AS count FROM {s}.books ORDER BY borrowed_count DESC LIMIT ?1",
+                      "SELECT * FROM {all} ORDER BY count DESC LIMIT ?1", fn, n);
+}
+
+// Rows of (day, issues, returns, fines) for the last `days` days that saw
+// any circulation, oldest first; a range on the daily_stats rowid.
+template<class Fn>
+static void for_each_daily_stats(Fn &&fn, int days = DEFAULT_STATS_DAYS){
+    flush_stats();
+    for_each_gathered("SELECT day,issues,returns,fines FROM {s}.daily_stats WHERE day > ?1 ORDER BY day",
+                      "SELECT day,SUM(issues) AS issues,SUM(returns) AS returns,SUM(fines) AS fines FROM {all} GROUP BY day ORDER BY day",
+                      fn, epoch_day(now_epoch()) - days);
+}
+
+// Rows of (category, loans, fines) since the analytics were introduced.
+template<class Fn>
+static void for_each_category_loans(Fn &&fn){
+    flush_stats();
+    for_each_gathered("SELECT category,loans,fines FROM {s}.category_loans ORDER BY loans DESC",
+                      "SELECT category,SUM(loans) AS loans,SUM(fines) AS fines FROM {all} GROUP BY category ORDER BY loans DESC", fn);
+}
+
+static void report_overdue(OutFormat fmt = OutFormat::Table){
+    if(fmt == OutFormat::Table) cout << "\nOverdue:\n";
+    RowWriter w(fmt, OVERDUE_COLUMNS);
+    for_each_overdue([&](const Row &t){ w.row(t); });
+}
+
+static void report_cache_stats(){
+    long long hits = CATALOG.hits, misses = CATALOG.misses;
+    cout << "\nCatalog cache: " << CATALOG.size() << "/" << CATALOG.capacity() << " books, hits " << hits << ", misses " << misses;
+    if(hits + misses > 0) cout << ", hit rate " << fixed << setprecision(1) << 100.0 * hits / (hits + misses) << "%";
+    cout << "\n";
+}
+
+static void report_circulation(){
+    cout << "\nCirculation, last " << DEFAULT_STATS_DAYS << " days:\n";
+    long long issues = 0, returns = 0, fines = 0;
+    for_each_daily_stats([&](const Row &r){
+        cout << date_text(r.int64(0) * SECS_PER_DAY) << " | Issued:" << r.int64(1) << " | Returned:" << r.int64(2) << " | Fines:₹" << r.int64(3) << "\n";
+        issues += r.int64(1); returns += r.int64(2); fines += r.int64(3);
+    });
+    cout << "Total | Issued:" << issues << " | Returned:" << returns << " | Fines:₹" << fines << "\n";
+    cout << "By category:\n";
+    for_each_category_loans([](const Row &r){
+        cout << (r.text(0).empty()? string_view("(none)") : r.text(0)) << " | Loans:" << r.int64(1) << " | Fines:₹" << r.int64(2) << "\n";
+    });
+}
+
+static void report_counter_check(){
+    auto c = rebuild_counters();
+    cout << "\nCounter check: " << c.total() << " corrected (active_loans " << c.active_loans << ", available_copies " << c.available
+         << ", borrowed_count " << c.borrowed << ", waiting_holds " << c.holds << ")\n";
+}
+
+static void report_top_borrowed(OutFormat fmt = OutFormat::Table){
+    if(fmt == OutFormat::Table) cout << "\nTop Borrowed Books:\n";
+    RowWriter w(fmt, TOP_COLUMNS);
+    for_each_top_borrowed([&](const Row &r){ w.row(r); });
+}
+
+// -------------------- Overdue notices --------------------
+// --notices [file] [--threads N] is the nightly job: every overdue loan gets
+// a notice line in a CSV spool file, and its accrued fine is written back
+// to transactions.fine (settled for real when the book comes back).
+// Members are split into one id range per thread; each thread scans its
+// range on its own connection, working in epoch days rather than parsing
+// dates, spools notices to a part file and then writes its fines back in
+// NOTICE_WRITE_BATCH-row transactions. Parts are joined in range order.
+// With branches, each shard is split the same way and its notices follow
+// those of the shard before it.
+const int NOTICE_WRITE_BATCH = 10000;
+const char *const DEFAULT_NOTICE_FILE = "notices.csv";
+
+struct NoticePart {
+    int shard = 0;
+    string lo, hi;              // member_id range [lo, hi); empty hi = open
+    string path;
+    long long loans = 0, members = 0, fines = 0, updated = 0;
+    string error;
+};
+
+static void run_notice_part(NoticePart &part, long long today){
+    try {
+        // a fresh thread: no connection to park yet
+        CUR_SHARD = part.shard;
+        open_db();
+        ofstream spool(part.path, ios::binary | ios::trunc);
+        if(!spool) throw runtime_error("cannot write " + part.path);
+        string buf;
+        buf.reserve(OUTPUT_BLOCK + 4096);
+        vector<pair<TxnId, int>> fines;
+        string last_member;
+        char num[24];
+        auto put_int = [&](long long v){ buf.append(num, to_chars(num, num + sizeof(num), v).ptr - num); };
+        // idx_txn_member_status gives a range seek per partition
+        for_each_row("SELECT t.txn_id,t.member_id,u.name,t.book_id,b.title,t.due_date,t.fine,u.category,b.loan_class FROM transactions t "
+                     "LEFT JOIN users u ON u.id=t.member_id LEFT JOIN books b ON b.book_id=t.book_id "
+                     "WHERE t.member_id >= ?1 AND (?2 = '' OR t.member_id < ?2) AND t.status=" SQL_BORROWED " AND t.due_date < ?3 "
+                     "ORDER BY t.member_id, t.due_date;", [&](const Row &r){
+            long long days = today - epoch_day(r.int64(5));
+            int fine = loan_fine(loan_rule(member_category(r.is_null(7)? -1 : r.int64(7)), loan_class(r.text(8))), days);
+            if(r.text(1) != last_member){ last_member.assign(r.text(1)); ++part.members; }
+            ++part.loans;
+            part.fines += fine;
+            if(r.is_null(6) || r.int64(6) != fine) fines.emplace_back(r.int64(0), fine);
+            put_int(r.int64(0)); buf += ',';
+            csv_field(buf, r.text(1)); buf += ',';
+            csv_field(buf, r.text(2)); buf += ',';
+            csv_field(buf, r.text(3)); buf += ',';
+            csv_field(buf, r.text(4)); buf += ',';
+            buf += date_text(r.int64(5)).view(); buf += ',';
+            put_int(days); buf += ',';
+            put_int(fine); buf += '\n';
+            if(buf.size() >= OUTPUT_BLOCK){ spool.write(buf.data(), buf.size()); buf.clear(); }
+        }, part.lo, part.hi, today * SECS_PER_DAY);
+        spool.write(buf.data(), buf.size());
+        if(!spool.flush()) throw runtime_error("write failed on " + part.path);
+
+        for(size_t i = 0; i < fines.size(); i += NOTICE_WRITE_BATCH){
+            Transaction tx;
+            size_t end = min(fines.size(), i + NOTICE_WRITE_BATCH);
+            for(size_t j = i; j < end; ++j){
+                exec_sql("UPDATE transactions SET fine=? WHERE txn_id=? AND status=" SQL_BORROWED ";", fines[j].second, fines[j].first);
+                part.updated += changes();
+            }
+            tx.commit();
+        }
+    } catch(const exception &e){
+        part.error = e.what();
+    }
+    close_db();
+}
+
+// Splits the current shard's member roster into n id ranges of equal size;
+// the boundaries are read off idx_users_role_id.
+static vector<NoticePart> plan_notice_parts(int n, const string &out){
+    auto rows = query_sql("SELECT COUNT(*) FROM users WHERE role=" SQL_MEMBER ";");
+    long long members = rows.empty()? 0 : stoll(rows[0][0]);
+    n = (int)max(1LL, min((long long)n, members));
+    vector<string> bounds(n + 1);
+    for(int i = 1; i < n; ++i){
+        auto b = query_sql("SELECT id FROM users WHERE role=" SQL_MEMBER " ORDER BY id LIMIT 1 OFFSET ?;", members * i / n);
+        if(!b.empty()) bounds[i] = b[0][0];
+    }
+    vector<NoticePart> parts(n);
+    for(int i = 0; i < n; ++i){
+        parts[i].shard = CUR_SHARD;
+        parts[i].lo = bounds[i];
+        parts[i].hi = bounds[i + 1];
+        parts[i].path = out + ".part" + to_string(CUR_SHARD) + "." + to_string(i);
+    }
+    return parts;
+}
+
+static int run_notices(const string &out, int threads){
+    auto t0 = chrono::steady_clock::now();
+    long long today = epoch_day(now_epoch());
+    vector<NoticePart> parts;
+    for(int s = 0; s < shard_count(); ++s){
+        ShardScope shard(s);
+        for(auto &p: plan_notice_parts(threads, out)) parts.push_back(move(p));
+    }
+    vector<thread> pool;
+    for(auto &p: parts) pool.emplace_back(run_notice_part, ref(p), today);
+    for(auto &t: pool) t.join();
+
+    ofstream dest(out, ios::binary | ios::trunc);
+    if(!dest) die("Cannot write " + out);
+    dest << "txn_id,member_id,name,book_id,title,due,days,fine\n";
+    long long loans = 0, members = 0, fines = 0, updated = 0;
+    bool failed = false;
+    for(auto &p: parts){
+        if(!p.error.empty()){ cerr << "range [" << p.lo << ", " << p.hi << "): " << p.error << "\n"; failed = true; }
+        ifstream in(p.path, ios::binary);
+        // inserting an empty rdbuf would set failbit on dest
+        if(in.peek() != ifstream::traits_type::eof()) dest << in.rdbuf();
+        in.close();
+        unlink(p.path.c_str());
+        loans += p.loans; members += p.members; fines += p.fines; updated += p.updated;
+    }
+    if(!dest.flush()) die("Write failed on " + out);
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cout << out << ": " << loans << " overdue loans, " << members << " members, fines ₹" << fines << " (" << updated
+         << " updated) using " << parts.size() << " thread(s) in " << fixed << setprecision(2) << secs << "s\n";
+    return failed? 1 : 0;
+}
+
+// -------------------- Bulk import --------------------
+// --import streams data/books.csv / data/members.csv style files straight from
+// a read-only mapping: fields are string_views into the file, rows are bound to
+// cached INSERT statements and committed IMPORT_BATCH rows at a time.
+const int IMPORT_BATCH = 50000;
+
+struct MappedFile {
+    const char *data = nullptr;
+    size_t size = 0;
+    explicit MappedFile(const string &path){
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) die("Cannot open " + path);
+        struct stat st{};
+        if(fstat(fd, &st) != 0){ close(fd); die("Cannot stat " + path); }
+        size = (size_t)st.st_size;
+        if(size > 0){
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p == MAP_FAILED){ close(fd); die("Cannot map " + path); }
+            madvise(p, size, MADV_SEQUENTIAL);
+            data = (const char*)p;
+        }
+        close(fd);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile &operator=(const MappedFile&) = delete;
+    ~MappedFile(){ if(data) munmap((void*)data, size); }
+};
+
+// Splits one CSV record starting at p and advances p past its line end.
+// Unquoted fields point into the mapping; quoted fields with "" escapes are
+// unescaped into scratch, whose buffers are reused from row to row (a deque,
+// so growing it never moves the buffers earlier fields point into).
+static bool next_csv_record(const char *&p, const char *end, vector<string_view> &fields, deque<string> &scratch){
+    fields.clear();
+    if(p >= end) return false;
+    while(true){
+        size_t idx = fields.size();
+        if(p < end && *p == '"'){
+            if(scratch.size() <= idx) scratch.resize(idx + 1);
+            string &buf = scratch[idx];
+            buf.clear();
+            ++p;
+            while(p < end){
+                if(*p == '"'){
+                    if(p + 1 < end && p[1] == '"'){ buf.push_back('"'); p += 2; }
+                    else { ++p; break; }
+                } else buf.push_back(*p++);
+            }
+            while(p < end && *p != ',' && *p != '\n') ++p;
+            fields.emplace_back(buf);
+        } else {
+            const char *start = p;
+            while(p < end && *p != ',' && *p != '\n') ++p;
+            const char *stop = p;
+            if(stop > start && stop[-1] == '\r') --stop;
+            fields.emplace_back(start, (size_t)(stop - start));
+        }
+        if(p >= end) return true;
+        if(*p++ == '\n') return true;
+    }
+}
+
+static string_view trim_view(string_view s){
+    while(!s.empty() && isspace((unsigned char)s.front())) s.remove_prefix(1);
+    while(!s.empty() && isspace((unsigned char)s.back())) s.remove_suffix(1);
+    return s;
+}
+
+static bool parse_int(string_view s, int &out){
+    s = trim_view(s);
+    auto res = from_chars(s.data(), s.data() + s.size(), out);
+    return res.ec == errc() && res.ptr == s.data() + s.size();
+}
+
+static int column_index(const vector<string_view> &header, string_view name){
+    for(size_t i=0;i<header.size();++i) if(trim_view(header[i]) == name) return (int)i;
+    return -1;
+}
+
+// Book rows are staged in a trigger-free temp table and moved into books with
+// one INSERT...SELECT per batch: FTS5 flushes its pending terms at every
+// statement boundary, so per-row inserts through the books_fts trigger would
+// write one tiny index segment per book. Re-importing a book keeps its
+// circulation state: copies on loan stay on loan, borrowed_count is untouched.
+// With branches, books already shelved at one are updated in its shard, in
+// one transaction there per batch; new books go to shard 0, as add-book
+// without a rack does.
+static void flush_book_batch(){
+    if(shard_count() > 1){
+        vector<string> staged, moved;
+        for_each_row("SELECT book_id FROM temp.import_books;", [&](const Row &r){ staged.emplace_back(r.text(0)); });
+        map<int, vector<string>> shelved;
+        for_each_gathered("SELECT {i} AS shard, book_id FROM {s}.books WHERE book_id IN (SELECT value FROM json_each(?1))",
+                          "SELECT * FROM {all} WHERE shard > 0", [&](const Row &r){ shelved[r.integer(0)].emplace_back(r.text(1)); }, json_ids(staged));
+        for(auto &[s, ids]: shelved){
+            auto rows = query_sql("SELECT book_id,title,author,isbn,copies FROM temp.import_books WHERE book_id IN (SELECT value FROM json_each(?));", json_ids(ids));
+            ShardScope shard(s);
+            Transaction tx;
+            for(auto &r: rows)
+                exec_sql("UPDATE books SET title=?2, author=?3, isbn=?4, available_copies = available_copies + ?5 - total_copies, total_copies=?5 WHERE book_id=?1;",
+                         r[0], r[1], r[2], r[3], stoi(r[4]));
+            tx.commit();
+            moved.insert(moved.end(), ids.begin(), ids.end());
+        }
+        if(!moved.empty()) exec_sql("DELETE FROM temp.import_books WHERE book_id IN (SELECT value FROM json_each(?));", json_ids(moved));
+    }
+    exec_sql("INSERT INTO books (book_id,title,author,isbn,total_copies,available_copies) "
+             "SELECT book_id,title,author,isbn,copies,copies FROM temp.import_books WHERE true "
+             "ON CONFLICT(book_id) DO UPDATE SET title=excluded.title, author=excluded.author, isbn=excluded.isbn, "
+             "available_copies = available_copies + excluded.total_copies - total_copies, total_copies=excluded.total_copies;");
+    exec_sql("DELETE FROM temp.import_books;");
+}
+
+static long import_books(const char *&p, const char *end, const vector<string_view> &header){
+    int c_id = column_index(header, "BookID"), c_title = column_index(header, "Title"),
+        c_author = column_index(header, "Author"), c_isbn = column_index(header, "ISBN"),
+        c_copies = column_index(header, "CopiesAvailable");
+    if(c_id < 0 || c_title < 0) die("books CSV needs BookID and Title columns");
+    exec_script("CREATE TEMP TABLE IF NOT EXISTS import_books (book_id TEXT, title TEXT, author TEXT, isbn TEXT, copies INTEGER);");
+    vector<string_view> f;
+    deque<string> scratch;
+    long line = 1, count = 0;
+    optional<Transaction> tx;
+    while(next_csv_record(p, end, f, scratch)){
+        ++line;
+        if(f.size()==1 && trim_view(f[0]).empty()) continue;
+        auto field = [&](int c){ return (c >= 0 && c < (int)f.size())? trim_view(f[c]) : string_view(); };
+        int copies = 1;
+        if(c_copies >= 0 && !field(c_copies).empty() && !parse_int(field(c_copies), copies)){
+            cerr << "line " << line << ": bad CopiesAvailable, skipped\n";
+            continue;
+        }
+        if(field(c_id).empty() || field(c_title).empty()){
+            cerr << "line " << line << ": missing BookID/Title, skipped\n";
+            continue;
+        }
+        if(!tx) tx.emplace();
+        exec_sql("INSERT INTO temp.import_books VALUES (?,?,?,?,?);",
+                 field(c_id), field(c_title), field(c_author), field(c_isbn), copies);
+        if(++count % IMPORT_BATCH == 0){ flush_book_batch(); tx->commit(); tx.reset(); }
+    }
+    if(tx){ flush_book_batch(); tx->commit(); }
+    return count;
+}
+
+// Members get their ID as initial password, like the seeded accounts.
+static long import_members(const char *&p, const char *end, const vector<string_view> &header){
+    int c_id = column_index(header, "MemberID"), c_name = column_index(header, "Name"),
+        c_role = column_index(header, "Role");
+    if(c_id < 0 || c_name < 0) die("members CSV needs MemberID and Name columns");
+    vector<string_view> f;
+    deque<string> scratch;
+    long line = 1, count = 0;
+    optional<Transaction> tx;
+    while(next_csv_record(p, end, f, scratch)){
+        ++line;
+        if(f.size()==1 && trim_view(f[0]).empty()) continue;
+        auto field = [&](int c){ return (c >= 0 && c < (int)f.size())? trim_view(f[c]) : string_view(); };
+        // CSV roles are the member category: Student/Faculty/Staff
+        char cat[16];
+        string_view role = field(c_role);
+        size_t n = role.size() < sizeof(cat)? role.size() : sizeof(cat);
+        for(size_t i=0;i<n;++i) cat[i] = (char)tolower((unsigned char)role[i]);
+        int category = name_index(CATEGORY_NAMES, string_view(cat, n));
+        if(category < 0){
+            cerr << "line " << line << ": unknown Role, skipped\n";
+            continue;
+        }
+        if(field(c_id).empty() || field(c_name).empty()){
+            cerr << "line " << line << ": missing MemberID/Name, skipped\n";
+            continue;
+        }
+        if(!tx) tx.emplace();
+        exec_sql("INSERT INTO users (id,name,password,role,category) VALUES (?1,?2,?1," SQL_MEMBER ",?3) "
+                 "ON CONFLICT(id) DO UPDATE SET name=excluded.name, category=excluded.category;",
+                 field(c_id), field(c_name), category);
+        if(++count % IMPORT_BATCH == 0){ tx->commit(); tx.reset(); }
+    }
+    if(tx) tx->commit();
+    return count;
+}
+
+// The file kind is taken from its header row.
+static void import_csv(const string &path){
+    MappedFile file(path);
+    const char *p = file.data, *end = file.data + file.size;
+    if(end - p >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0) p += 3;
+    vector<string_view> header;
+    deque<string> scratch;
+    if(!next_csv_record(p, end, header, scratch)){ cout << path << ": empty\n"; return; }
+    auto t0 = chrono::steady_clock::now();
+    long n;
+    const char *kind;
+    if(column_index(header, "BookID") >= 0){ n = import_books(p, end, header); kind = "books"; }
+    else if(column_index(header, "MemberID") >= 0){ n = import_members(p, end, header); kind = "members"; }
+    else die(path + ": unrecognised header (expected BookID,... or MemberID,...)");
+    CATALOG.clear();
+    FUZZY.invalidate();
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cout << path << ": imported " << n << " " << kind << " in " << fixed << setprecision(3) << secs << "s\n";
+}
+
+// -------------------- Snapshots --------------------
+// --snapshot file [--since base.snap] writes users, books, transactions,
+// reservations and the analytics tables to one binary file; --restore
+// loads one or more of them in order. Snapshots are taken inside a read
+// transaction, so under WAL they can be produced while the library is in
+// use and always see one committed state.
+//
+// Layout (host byte order, every structure 8-byte aligned so a mapping can
+// be read in place):
+//   SnapshotHeader
+//   per table: SnapshotTableHeader, column names (char[24] each), then
+//     blocks of up to SNAPSHOT_BLOCK_ROWS rows, ended by a 0-row block.
+//     A block stores each column contiguously: SnapshotColumnHeader, a
+//     null bitmap, then int64 values or (rows+1) uint64 offsets and text.
+//   SnapshotFooter
+// Headers, column name lists and block bodies each carry a CRC-32.
+//
+// An incremental snapshot (--since) copies transactions only where they can
+// differ from the base: loans issued after it, loans still open, and loans
+// returned since it was taken. The other tables are copied whole; they are
+// bounded by catalog and roster size and carry the counters derived from
+// transactions.
+const uint32_t SNAPSHOT_FORMAT = 3;     // 2: books.loan_class, 3: integer role/category/status codes
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+const uint32_t SNAPSHOT_INCREMENTAL = 1;
+const size_t SNAPSHOT_BLOCK_ROWS = 65536;
+const size_t SNAPSHOT_NAME_LEN = 24;
+// return dates are taken before commit; look back this far past the base
+const long long SNAPSHOT_CLOCK_SLACK = 60;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t format, schema, byte_order, flags;
+    int64_t created;        // Unix seconds when the read transaction began
+    int64_t since_txn;      // incremental: base snapshot's max_txn
+    int64_t since_time;     // incremental: base snapshot's created
+    int64_t max_txn;
+    uint32_t tables, crc;   // crc of this header with crc = 0
+};
+struct SnapshotTableHeader { char name[SNAPSHOT_NAME_LEN]; uint32_t columns, crc; };
+struct SnapshotBlockHeader { uint64_t rows, bytes; uint32_t crc, columns; };
+struct SnapshotColumnHeader { uint32_t kind, reserved; uint64_t bytes; };
+struct SnapshotFooter { char magic[8]; uint64_t rows; };
+static_assert(sizeof(SnapshotHeader) == 64 && sizeof(SnapshotTableHeader) % 8 == 0 && sizeof(SnapshotBlockHeader) % 8 == 0
+              && sizeof(SnapshotColumnHeader) % 8 == 0 && sizeof(SnapshotFooter) % 8 == 0, "snapshot alignment");
+
+const char SNAPSHOT_MAGIC[8] = "LMSSNAP";
+const char SNAPSHOT_END[8] = "LMSSEND";
+enum : uint32_t { SNAP_INT = 0, SNAP_TEXT = 1 };
+
+// The first column is the primary key. Restore order matters: transactions
+// and reservations go first because their triggers touch users and books,
+// which are then set to the snapshot's own copies.
+struct SnapshotTable {
+    const char *name;
+    const char *columns;
+    bool delta;     // incremental snapshots copy part of it
+};
+static const SnapshotTable SNAPSHOT_TABLES[] = {
+    {"transactions", "txn_id,member_id,book_id,issue_date,due_date,return_date,fine,status", true},
+    {"reservations", "res_id,book_id,member_id,res_date,status", false},
+    {"users", "id,name,password,role,category,active_loans", false},
+    {"books", "book_id,isbn,title,author,publisher,year,rack,total_copies,available_copies,borrowed_count,waiting_holds,loan_class", false},
+    {"daily_stats", "day,issues,returns,fines", false},
+    {"category_loans", "category,loans,fines", false},
+};
+const uint32_t SNAPSHOT_TABLE_COUNT = sizeof(SNAPSHOT_TABLES) / sizeof(SNAPSHOT_TABLES[0]);
+
+static uint32_t crc32(const void *data, size_t n, uint32_t crc = 0){
+    static const array<uint32_t, 256> table = []{
+        array<uint32_t, 256> t{};
+        for(uint32_t i = 0; i < 256; ++i){
+            uint32_t c = i;
+            for(int k = 0; k < 8; ++k) c = (c & 1)? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    const unsigned char *p = (const unsigned char*)data;
+    crc = ~crc;
+    for(size_t i = 0; i < n; ++i) crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t header_crc(SnapshotHeader h){
+    h.crc = 0;
+    return crc32(&h, sizeof(h));
+}
+
+static vector<string> split_columns(const char *list){
+    vector<string> out;
+    stringstream ss(list);
+    for(string c; getline(ss, c, ',');) out.push_back(c);
+    return out;
+}
+
+// Statement built at run time for one table; kept out of STMT_CACHE, whose
+// keys must be literals.
+struct OwnedStmt {
+    sqlite3_stmt *stmt = nullptr;
+    string sql;
+    explicit OwnedStmt(string text): sql(move(text)){
+        int rc = sqlite3_prepare_v2(DB, sql.c_str(), -1, &stmt, nullptr);
+        if(rc != SQLITE_OK) throw_db_error(rc, "Failed to prepare query", sql.c_str());
+    }
+    OwnedStmt(const OwnedStmt&) = delete;
+    OwnedStmt &operator=(const OwnedStmt&) = delete;
+    ~OwnedStmt(){ sqlite3_finalize(stmt); }
+    int step(){
+        int rc = sqlite3_step(stmt);
+        if(rc != SQLITE_ROW && rc != SQLITE_DONE) throw_db_error(rc, "SQL error", sql.c_str());
+        return rc;
+    }
+};
+
+// One column of the block being written. Columns start as integers; the
+// first value that is not one turns the column into text for this block.
+struct SnapColumn {
+    bool text = false;
+    vector<uint8_t> nulls;
+    vector<int64_t> ints;
+    vector<uint64_t> offsets;
+    string bytes;
+
+    void clear(){
+        text = false;
+        nulls.assign((SNAPSHOT_BLOCK_ROWS + 7) / 8, 0);
+        ints.clear();
+        offsets.assign(1, 0);
+        bytes.clear();
+    }
+    bool is_null(size_t row) const { return nulls[row / 8] >> (row % 8) & 1; }
+    void to_text(size_t rows){
+        for(size_t j = 0; j < rows; ++j){
+            if(!is_null(j)) bytes += to_string(ints[j]);
+            offsets.push_back(bytes.size());
+        }
+        ints.clear();
+        text = true;
+    }
+    void add(const Row &r, int i, size_t row){
+        bool null = r.is_null(i);
+        if(null) nulls[row / 8] |= (uint8_t)(1 << (row % 8));
+        else if(!text && !r.is_int(i)) to_text(row);
+        if(text){
+            if(!null) bytes += r.text(i);
+            offsets.push_back(bytes.size());
+        }
+        else ints.push_back(null? 0 : r.int64(i));
+    }
+};
+
+static void append_padded(string &out, const void *data, size_t n){
+    out.append((const char*)data, n);
+    out.append((8 - n % 8) % 8, '\0');
+}
+
+static void write_snapshot_block(ostream &out, vector<SnapColumn> &cols, size_t rows, string &body){
+    body.clear();
+    for(auto &c: cols){
+        size_t bitmap = (rows + 7) / 8, padded = (bitmap + 7) / 8 * 8;
+        size_t payload = c.text? (rows + 1) * 8 + (c.bytes.size() + 7) / 8 * 8 : rows * 8;
+        SnapshotColumnHeader h{c.text? SNAP_TEXT : SNAP_INT, 0, padded + payload};
+        body.append((const char*)&h, sizeof(h));
+        append_padded(body, c.nulls.data(), bitmap);
+        if(c.text){
+            body.append((const char*)c.offsets.data(), (rows + 1) * 8);
+            append_padded(body, c.bytes.data(), c.bytes.size());
+        }
+        else body.append((const char*)c.ints.data(), rows * 8);
+        c.clear();
+    }
+    SnapshotBlockHeader bh{rows, body.size(), crc32(body.data(), body.size()), (uint32_t)cols.size()};
+    out.write((const char*)&bh, sizeof(bh));
+    out.write(body.data(), body.size());
+}
+
+static bool read_snapshot_header(const string &path, SnapshotHeader &h){
+    ifstream in(path, ios::binary);
+    if(!in.read((char*)&h, sizeof(h))){ cerr << path << ": not a snapshot\n"; return false; }
+    if(memcmp(h.magic, SNAPSHOT_MAGIC, 8) != 0 || h.crc != header_crc(h)){ cerr << path << ": not a snapshot or header damaged\n"; return false; }
+    if(h.format != SNAPSHOT_FORMAT || h.byte_order != SNAPSHOT_BYTE_ORDER){ cerr << path << ": unsupported snapshot format\n"; return false; }
+    return true;
+}
+
+// Ends the export's read transaction however write_snapshot leaves.
+struct ReadSnapshot {
+    ReadSnapshot(){ exec_script("BEGIN;"); }
+    ~ReadSnapshot(){ if(!sqlite3_get_autocommit(DB)) sqlite3_exec(DB, "COMMIT;", nullptr, nullptr, nullptr); }
+};
+
+static int write_snapshot(const string &path, const string &base){
+    // a snapshot covers one database; with branches it would leave them out
+    if(shard_count() > 1){ cerr << "--snapshot covers only the main database and can't be used with LMS_BRANCHES set; back up every branch database file instead\n"; return 2; }
+    flush_stats();
+    SnapshotHeader h{};
+    memcpy(h.magic, SNAPSHOT_MAGIC, 8);
+    h.format = SNAPSHOT_FORMAT;
+    h.schema = SCHEMA_VERSION;
+    h.byte_order = SNAPSHOT_BYTE_ORDER;
+    h.tables = SNAPSHOT_TABLE_COUNT;
+    if(!base.empty()){
+        SnapshotHeader b;
+        if(!read_snapshot_header(base, b)) return 2;
+        if(b.schema != SCHEMA_VERSION){ cerr << base << ": taken at schema version " << b.schema << ", take a new full snapshot\n"; return 2; }
+        h.flags = SNAPSHOT_INCREMENTAL;
+        h.since_txn = b.max_txn;
+        h.since_time = b.created;
+    }
+    auto t0 = chrono::steady_clock::now();
+    string tmp = path + ".tmp";
+    ofstream out(tmp, ios::binary | ios::trunc);
+    if(!out) die("Cannot write " + tmp);
+
+    ReadSnapshot snap;
+    h.created = now_epoch();
+    // the first read fixes the snapshot every table below is read from
+    for_each_row("SELECT COALESCE(MAX(txn_id),0) FROM transactions;", [&](const Row &r){ h.max_txn = r.int64(0); });
+    h.crc = header_crc(h);
+    out.write((const char*)&h, sizeof(h));
+
+    uint64_t total = 0;
+    string body;
+    for(auto &t: SNAPSHOT_TABLES){
+        vector<string> names = split_columns(t.columns);
+        SnapshotTableHeader th{};
+        strncpy(th.name, t.name, SNAPSHOT_NAME_LEN - 1);
+        th.columns = (uint32_t)names.size();
+        string name_block(names.size() * SNAPSHOT_NAME_LEN, '\0');
+        for(size_t i = 0; i < names.size(); ++i) names[i].copy(&name_block[i * SNAPSHOT_NAME_LEN], SNAPSHOT_NAME_LEN - 1);
+        th.crc = crc32(name_block.data(), name_block.size());
+        out.write((const char*)&th, sizeof(th));
+        out.write(name_block.data(), name_block.size());
+
+        string sql = string("SELECT ") + t.columns + " FROM " + t.name;
+        bool delta = t.delta && (h.flags & SNAPSHOT_INCREMENTAL);
+        if(delta) sql += " WHERE txn_id > ?1 OR status=" SQL_BORROWED " OR return_date >= ?2";
+        OwnedStmt sel(sql);
+        if(delta){
+            sqlite3_bind_int64(sel.stmt, 1, h.since_txn);
+            sqlite3_bind_int64(sel.stmt, 2, h.since_time - SNAPSHOT_CLOCK_SLACK);
+        }
+        vector<SnapColumn> cols(names.size());
+        for(auto &c: cols) c.clear();
+        Row row{sel.stmt};
+        size_t n = 0;
+        uint64_t rows = 0;
+        while(sel.step() == SQLITE_ROW){
+            for(int i = 0; i < (int)cols.size(); ++i) cols[i].add(row, i, n);
+            ++rows;
+            if(++n == SNAPSHOT_BLOCK_ROWS){ write_snapshot_block(out, cols, n, body); n = 0; }
+        }
+        if(n > 0) write_snapshot_block(out, cols, n, body);
+        SnapshotBlockHeader end_block{0, 0, 0, (uint32_t)cols.size()};
+        out.write((const char*)&end_block, sizeof(end_block));
+        cout << setw(16) << left << t.name << rows << " rows" << (delta? " (since last snapshot)" : "") << "\n";
+        total += rows;
+    }
+    SnapshotFooter f{};
+    memcpy(f.magic, SNAPSHOT_END, 8);
+    f.rows = total;
+    out.write((const char*)&f, sizeof(f));
+    if(!out.flush()) die("Write failed on " + tmp);
+    out.close();
+    if(rename(tmp.c_str(), path.c_str()) != 0) die("Cannot rename " + tmp + " to " + path);
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    struct stat st{};
+    stat(path.c_str(), &st);
+    cout << path << ": " << (h.flags & SNAPSHOT_INCREMENTAL? "incremental" : "full") << " snapshot, " << total << " rows, "
+         << st.st_size / 1024 << " KiB in " << fixed << setprecision(2) << secs << "s (max txn " << h.max_txn << ")\n";
+    return 0;
+}
+
+// Bounds-checked cursor over a mapped snapshot.
+struct SnapshotReader {
+    const char *p, *end;
+    template<class T>
+    const T *take(size_t n = 1){
+        size_t bytes = n * sizeof(T);
+        if((size_t)(end - p) < bytes) return nullptr;
+        const T *out = (const T*)p;
+        p += bytes;
+        return out;
+    }
+};
+
+// One decoded column of a mapped block; all pointers are into the file.
+struct SnapColumnView {
+    uint32_t kind;
+    const uint8_t *nulls;
+    const int64_t *ints;
+    const uint64_t *offsets;
+    const char *text;
+    uint64_t text_bytes;
+};
+
+static bool decode_snapshot_block(const char *body, uint64_t bytes, uint64_t rows, uint32_t columns, vector<SnapColumnView> &cols){
+    SnapshotReader rd{body, body + bytes};
+    cols.clear();
+    uint64_t bitmap = ((rows + 7) / 8 + 7) / 8 * 8;
+    for(uint32_t c = 0; c < columns; ++c){
+        auto h = rd.take<SnapshotColumnHeader>();
+        if(!h || h->bytes < bitmap) return false;
+        const char *data = rd.take<char>(h->bytes);
+        if(!data) return false;
+        SnapColumnView v{h->kind, (const uint8_t*)data, nullptr, nullptr, nullptr, 0};
+        uint64_t payload = h->bytes - bitmap;
+        if(h->kind == SNAP_INT){
+            if(payload != rows * 8) return false;
+            v.ints = (const int64_t*)(data + bitmap);
+        } else if(h->kind == SNAP_TEXT){
+            if(payload < (rows + 1) * 8) return false;
+            v.offsets = (const uint64_t*)(data + bitmap);
+            v.text = data + bitmap + (rows + 1) * 8;
+            v.text_bytes = payload - (rows + 1) * 8;
+            for(uint64_t r = 0; r < rows; ++r) if(v.offsets[r] > v.offsets[r + 1]) return false;
+            if(v.offsets[0] != 0 || v.offsets[rows] > v.text_bytes) return false;
+        } else return false;
+        cols.push_back(v);
+    }
+    return rd.p == rd.end;
+}
+
+// Applies one snapshot inside a single write transaction; any damage found
+// on the way rolls the whole file back.
+static bool restore_snapshot(const string &path){
+    if(shard_count() > 1){ cerr << path << ": --restore loads only the main database and can't be used with LMS_BRANCHES set\n"; return false; }
+    SnapshotHeader h;
+    if(!read_snapshot_header(path, h)) return false;
+    if(h.schema != SCHEMA_VERSION){ cerr << path << ": taken at schema version " << h.schema << ", this program is at " << SCHEMA_VERSION << "\n"; return false; }
+    if(h.tables != SNAPSHOT_TABLE_COUNT){ cerr << path << ": unexpected table count\n"; return false; }
+    bool incremental = h.flags & SNAPSHOT_INCREMENTAL;
+    auto t0 = chrono::steady_clock::now();
+    MappedFile file(path);
+    SnapshotReader rd{file.data + sizeof(SnapshotHeader), file.data + file.size};
+    auto bad = [&](const string &what){ cerr << path << ": " << what << ", nothing restored\n"; return false; };
+
+    // one-shot mode: a big page cache keeps the index builds off the WAL
+    exec_script("PRAGMA cache_size=-262144; PRAGMA temp_store=MEMORY;");
+    Transaction tx;
+    if(incremental){
+        long long have = 0;
+        for_each_row("SELECT COALESCE(MAX(txn_id),0) FROM transactions;", [&](const Row &r){ have = r.int64(0); });
+        if(have < h.since_txn) return bad("incremental snapshot is newer than this database; restore its base first");
+    }
+    uint64_t total = 0;
+    vector<SnapColumnView> cols;
+    for(auto &t: SNAPSHOT_TABLES){
+        vector<string> names = split_columns(t.columns);
+        auto th = rd.take<SnapshotTableHeader>();
+        if(!th || strncmp(th->name, t.name, SNAPSHOT_NAME_LEN) != 0 || th->columns != names.size()) return bad(string("expected table ") + t.name);
+        const char *name_block = rd.take<char>(names.size() * SNAPSHOT_NAME_LEN);
+        if(!name_block || crc32(name_block, names.size() * SNAPSHOT_NAME_LEN) != th->crc) return bad(string("damaged header for ") + t.name);
+        for(size_t i = 0; i < names.size(); ++i)
+            if(strncmp(name_block + i * SNAPSHOT_NAME_LEN, names[i].c_str(), SNAPSHOT_NAME_LEN) != 0) return bad(string("column mismatch in ") + t.name);
+
+        auto t1 = chrono::steady_clock::now();
+        string name = t.name, stage = "temp.snap_" + name;
+        exec_script(("DROP TABLE IF EXISTS " + stage + "; CREATE TEMP TABLE snap_" + name + " AS SELECT " + t.columns
+                     + " FROM main." + name + " WHERE 0;").c_str());
+        string marks;
+        for(size_t i = 0; i < names.size(); ++i) marks += i? ",?" : "?";
+        OwnedStmt ins("INSERT INTO " + stage + " VALUES (" + marks + ")");
+
+        uint64_t rows = 0;
+        while(true){
+            auto bh = rd.take<SnapshotBlockHeader>();
+            if(!bh || bh->columns != names.size()) return bad(string("truncated in ") + t.name);
+            if(bh->rows == 0) break;
+            const char *body = rd.take<char>(bh->bytes);
+            if(!body) return bad(string("truncated in ") + t.name);
+            if(crc32(body, bh->bytes) != bh->crc) return bad(string("checksum mismatch in ") + t.name);
+            if(!decode_snapshot_block(body, bh->bytes, bh->rows, bh->columns, cols)) return bad(string("malformed block in ") + t.name);
+            for(uint64_t r = 0; r < bh->rows; ++r){
+                for(int c = 0; c < (int)cols.size(); ++c){
+                    const SnapColumnView &v = cols[c];
+                    if(v.nulls[r / 8] >> (r % 8) & 1) sqlite3_bind_null(ins.stmt, c + 1);
+                    else if(v.kind == SNAP_INT) sqlite3_bind_int64(ins.stmt, c + 1, v.ints[r]);
+                    else sqlite3_bind_text(ins.stmt, c + 1, v.text + v.offsets[r], (int)(v.offsets[r + 1] - v.offsets[r]), SQLITE_STATIC);
+                }
+                ins.step();
+                sqlite3_reset(ins.stmt);
+            }
+            rows += bh->rows;
+        }
+        // Merge the staged rows: rows the snapshot lacks go (except from a
+        // delta), and only rows that differ are written, so unchanged books
+        // are not re-indexed by books_fts and unchanged loans fire no
+        // triggers. One statement each, as in flush_book_batch.
+        string set, mine, theirs;
+        for(size_t i = 1; i < names.size(); ++i){
+            const char *sep = i > 1? "," : "";
+            set += sep + names[i] + "=excluded." + names[i];
+            mine += sep + name + "." + names[i];
+            theirs += sep + string("excluded.") + names[i];
+        }
+        string merge;
+        if(!(t.delta && incremental))
+            merge = "DELETE FROM main." + name + " WHERE " + names[0] + " NOT IN (SELECT " + names[0] + " FROM " + stage + "); ";
+        merge += "INSERT INTO main." + name + " (" + t.columns + ") SELECT * FROM " + stage + " WHERE true ON CONFLICT("
+                 + names[0] + ") DO UPDATE SET " + set + " WHERE (" + mine + ") IS NOT (" + theirs + "); DROP TABLE " + stage + ";";
+        exec_script(merge.c_str());
+        cout << setw(16) << left << t.name << setw(10) << rows << fixed << setprecision(2)
+             << chrono::duration<double>(chrono::steady_clock::now() - t1).count() << "s\n";
+        total += rows;
+    }
+    auto f = rd.take<SnapshotFooter>();
+    if(!f || memcmp(f->magic, SNAPSHOT_END, 8) != 0 || f->rows != total) return bad("missing or damaged footer");
+    // the merge logs only some of what it changed (see Change log)
+    exec_sql("INSERT INTO change_log (at,kind) VALUES (?,?);", now_epoch(), (int)ChangeKind::Reset);
+    tx.commit();
+    CATALOG.clear();
+    FUZZY.invalidate();
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cout << path << ": restored " << (incremental? "incremental" : "full") << " snapshot, " << total << " rows in "
+         << fixed << setprecision(2) << secs << "s\n";
+    return true;
+}
+
+// -------------------- Batch mode --------------------
+// --batch [file] [--batch-size N] runs one command per line (stdin when no
+// file is given) through the circulation core, without menus:
+//   issue <member_id> <book_id> [<book_id> ...]
+//   return <txn_id> [<txn_id> ...]
+//   reserve <member_id> <book_id>
+//   cancel <member_id> <book_id> | cancel-all <member_id> | expire <days>
+//   prune-changes <days>
+//   add-book <book_id> <title> [author] [isbn] [copies] [rack] [loan class]
+//   report overdue|top [table|csv|json] | report cache|circulation|stats|policy
+//   check-counters
+//   list books|users|members|borrowed [after=K] [limit=N] [available] [author=A] [role=R] [member=M] [overdue]
+//        [format=table|csv|json]
+// Words may be "double quoted"; blank lines and # comments are skipped.
+// Several ids make a desk stack, issued or returned all or nothing.
+// Commands commit in groups of batch-size, but each still succeeds or fails
+// on its own. Every command gets a "<line> ok|err <command> <detail>" line.
+const int DEFAULT_BATCH_SIZE = 1000;
+
+static void split_words(const string &line, vector<string> &words){
+    words.clear();
+    size_t i = 0, n = line.size();
+    while(true){
+        while(i < n && isspace((unsigned char)line[i])) ++i;
+        if(i >= n || line[i] == '#') return;
+        string w;
+        if(line[i] == '"'){
+            for(++i; i < n && line[i] != '"'; ++i) w.push_back(line[i]);
+            ++i;
+        } else {
+            for(; i < n && !isspace((unsigned char)line[i]); ++i) w.push_back(line[i]);
+        }
+        words.push_back(move(w));
+    }
+}
+
+// Paged listings shared by batch mode and the service.
+enum class ListKind { Books, Users, Members, Borrowed };
+
+static bool parse_list_kind(string_view s, ListKind &k){
+    if(s == "books") k = ListKind::Books;
+    else if(s == "users") k = ListKind::Users;
+    else if(s == "members") k = ListKind::Members;
+    else if(s == "borrowed") k = ListKind::Borrowed;
+    else return false;
+    return true;
+}
+
+// Applies one after=/limit=/filter option; false if unknown or invalid.
+static bool set_list_option(string_view key, string_view value, ListFilter &f, string &after, int &limit){
+    if(key == "after") after = value;
+    else if(key == "limit") return parse_int(value, limit) && limit >= 1 && limit <= MAX_PAGE_SIZE;
+    else if(key == "available") f.available_only = value != "0";
+    else if(key == "author") f.author = value;
+    else if(key == "role"){
+        int i = name_index(ROLE_NAMES, value);
+        if(i < 0) return false;
+        f.role = (Role)i;
+    }
+    else if(key == "member") f.member = value;
+    else if(key == "overdue") f.overdue_only = value != "0";
+    else return false;
+    return true;
 }
 
-static long days_between_dates_iso(const string &d1_iso, const string &d2_iso){
-    // d1_iso, d2_iso: "YYYY-MM-DD..." we compare dates part
-    tm t1{}; tm t2{};
-    string a = d1_iso.substr(0,10);
-    string b = d2_iso.substr(0,10);
-    strptime(a.c_str(), "%Y-%m-%d", &t1);
-    strptime(b.c_str(), "%Y-%m-%d", &t2);
-    time_t tt1 = timegm(&t1);
-    time_t tt2 = timegm(&t2);
-    return (tt2 - tt1) / 86400;
+static const vector<Column> &list_columns(ListKind k){
+    switch(k){
+        case ListKind::Books: return BOOK_COLUMNS;
+        case ListKind::Users: return USER_COLUMNS;
+        case ListKind::Members: return MEMBER_COLUMNS;
+        case ListKind::Borrowed: break;
+    }
+    return LOAN_COLUMNS;
 }
 
-// -------------------- Authentication --------------------
-struct User {
-    string id,name,role,category;
-};
+template<class Fn>
+static bool page_list(ListKind k, ListFilter f, const string &after, int limit, string &next, Fn &&fn){
+    switch(k){
+        case ListKind::Books: return page_books(f, after, limit, next, fn);
+        case ListKind::Users: return page_users(f, after, limit, next, fn);
+        case ListKind::Members: f.role = Role::Member; return page_users(f, after, limit, next, fn);
+        case ListKind::Borrowed: return page_borrowed(f, after, limit, next, fn);
+    }
+    return false;
+}
 
-static bool login(User &user){
-    cout << "\n--- Login ---\n";
-    string uid = read_nonempty("User ID: ");
-    string pwd = prompt("Password: ");
-    string sql = "SELECT id,name,role,category FROM users WHERE id='" + escape_sql(uid) + "' AND password='" + escape_sql(pwd) + "';";
-    auto rows = query_sql(sql);
-    if (!rows.empty()){
-        user.id = rows[0][0];
-        user.name = rows[0][1];
-        user.role = rows[0][2];
-        user.category = rows[0][3];
-        cout << "Welcome " << user.name << " (" << user.role << ")\n";
+// Runs one parsed command and writes its detail; returns false on failure.
+static bool run_command(const vector<string> &w, ostream &out){
+    const string &cmd = w[0];
+    if(cmd == "issue" && w.size() == 3){
+        auto res = issue_book_core(w[1], w[2]);
+        if(res.status != Status::Ok){ out << status_text(res.status); return false; }
+        out << res.txn << " due=" << date_text(res.due);
+        return true;
+    }
+    if(cmd == "issue" && w.size() > 3){
+        auto res = issue_books_core(w[1], vector<string>(w.begin() + 2, w.end()));
+        if(res.status != Status::Ok){ out << status_text(res.status) << (res.failed.empty()? "" : ": ") << res.failed; return false; }
+        for(size_t i = 0; i < res.loans.size(); ++i)
+            out << (i? "; " : "") << res.loans[i].txn << " due=" << date_text(res.loans[i].due);
+        return true;
+    }
+    if(cmd == "return" && w.size() > 2){
+        vector<TxnId> txns(w.size() - 1);
+        for(size_t i = 1; i < w.size(); ++i)
+            if(!parse_txn_id(w[i], txns[i - 1])){ out << "bad txn id: " << w[i]; return false; }
+        auto res = return_books_core(txns);
+        if(res.status != Status::Ok){ out << status_text(res.status) << (res.failed.empty()? "" : ": ") << res.failed; return false; }
+        for(size_t i = 0; i < res.returns.size(); ++i){
+            auto &r = res.returns[i];
+            out << (i? "; " : "") << txns[i] << " fine=" << r.fine;
+            if(r.next_txn != 0) out << " reissued=" << r.next_txn << " to=" << r.next_member;
+        }
+        return true;
+    }
+    if(cmd == "return" && w.size() == 2){
+        TxnId txn;
+        if(!parse_txn_id(w[1], txn)){ out << "bad txn id"; return false; }
+        auto res = return_book_core(txn);
+        if(res.status != Status::Ok){ out << status_text(res.status); return false; }
+        out << "fine=" << res.fine;
+        if(res.next_txn != 0) out << " reissued=" << res.next_txn << " to=" << res.next_member;
+        return true;
+    }
+    if(cmd == "reserve" && w.size() == 3){
+        Status s = reserve_book_core(w[1], w[2]);
+        out << status_text(s);
+        return s == Status::Ok;
+    }
+    if(cmd == "cancel" && w.size() == 3){
+        Status s = cancel_hold(w[1], w[2]);
+        out << status_text(s);
+        return s == Status::Ok;
+    }
+    if(cmd == "cancel-all" && w.size() == 2){
+        out << "cancelled=" << cancel_member_holds(w[1]);
+        return true;
+    }
+    if(cmd == "expire" && w.size() == 2){
+        int days;
+        if(!parse_int(w[1], days) || days < 0){ out << "bad days"; return false; }
+        out << "expired=" << expire_holds(days);
         return true;
-    } else {
-        cout << "Invalid credentials.\n";
-        return false;
     }
+    if(cmd == "prune-changes" && w.size() == 2){
+        int days;
+        if(!parse_int(w[1], days) || days < 0){ out << "bad days"; return false; }
+        out << "pruned=" << prune_changes(days);
+        return true;
+    }
+    if(cmd == "add-book" && w.size() >= 3 && w.size() <= 8){
+        BookInput b;
+        b.book_id = w[1];
+        b.title = w[2];
+        if(w.size() > 3) b.author = w[3];
+        if(w.size() > 4) b.isbn = w[4];
+        if(w.size() > 5 && !parse_int(w[5], b.copies)){ out << "bad copies"; return false; }
+        if(w.size() > 6) b.rack = w[6];
+        if(w.size() > 7){
+            if(name_index(LOAN_CLASS_NAMES, w[7]) < 0){ out << "bad loan class"; return false; }
+            b.loan_class = loan_class(w[7]);
+        }
+        save_book(b);
+        out << b.book_id;
+        return true;
+    }
+    if(cmd == "report" && (w.size() == 2 || w.size() == 3) && (w[1] == "overdue" || w[1] == "top")){
+        OutFormat fmt = OutFormat::Table;
+        if(w.size() == 3 && !parse_format(w[2], fmt)){ out << "bad format"; return false; }
+        if(w[1] == "overdue") report_overdue(fmt);
+        else report_top_borrowed(fmt);
+        out << w[1];
+        return true;
+    }
+    if(cmd == "report" && w.size() == 2 && (w[1] == "cache" || w[1] == "circulation" || w[1] == "stats" || w[1] == "policy")){
+        if(w[1] == "circulation") report_circulation();
+        else if(w[1] == "stats") print_query_stats(cout);
+        else if(w[1] == "policy") print_policy(cout);
+        else report_cache_stats();
+        out << w[1];
+        return true;
+    }
+    if(cmd == "list" && w.size() >= 2){
+        ListKind kind;
+        if(!parse_list_kind(w[1], kind)){ out << "unknown list"; return false; }
+        ListFilter f;
+        string after, next;
+        int limit = PAGE_SIZE;
+        OutFormat fmt = OutFormat::Table;
+        for(size_t i = 2; i < w.size(); ++i){
+            string_view opt = w[i];
+            size_t eq = opt.find('=');
+            string_view key = opt.substr(0, eq), value = eq == string_view::npos? string_view("1") : opt.substr(eq + 1);
+            bool good = key == "format"? parse_format(value, fmt) : set_list_option(key, value, f, after, limit);
+            if(!good){ out << "bad option " << opt; return false; }
+        }
+        RowWriter rw(fmt, list_columns(kind));
+        bool more = page_list(kind, f, after, limit, next, [&](const Row &r){ rw.row(r); });
+        rw.finish();
+        out << "rows=" << rw.count();
+        if(more) out << " next=" << next;
+        return true;
+    }
+    if(cmd == "check-counters" && w.size() == 1){
+        auto c = rebuild_counters();
+        out << "corrected=" << c.total() << " active_loans=" << c.active_loans << " available=" << c.available
+            << " borrowed=" << c.borrowed << " holds=" << c.holds;
+        return true;
+    }
+    out << "unknown command or wrong arguments";
+    return false;
 }
 
-// -------------------- Admin functions --------------------
-static void list_books(){
-    auto rows = query_sql("SELECT book_id,isbn,title,author,available_copies,total_copies FROM books;");
-    cout << "\nBooks:\n";
-    cout << left << setw(8) << "ID" << setw(18) << "ISBN" << setw(40) << "Title" << setw(20) << "Author" << setw(8) << "Avail" << setw(8) << "Total" << "\n";
-    for(auto &r: rows){
-        cout << setw(8) << r[0] << setw(18) << r[1] << setw(40) << (r[2].size()>38? r[2].substr(0,35)+"...": r[2]) << setw(20) << (r[3].size()>18? r[3].substr(0,17)+"...": r[3]) << setw(8) << r[4] << setw(8) << r[5] << "\n";
+// --export writes a whole listing or report to stdout, walking lists a
+// MAX_PAGE_SIZE page at a time so memory stays flat on any table size.
+static bool export_listing(const string &what, OutFormat fmt){
+    if(what == "overdue"){ report_overdue(fmt); return true; }
+    if(what == "top"){ report_top_borrowed(fmt); return true; }
+    ListKind kind;
+    if(!parse_list_kind(what, kind)){
+        cerr << "Unknown listing: " << what << " (books|users|members|borrowed|overdue|top)\n";
+        return false;
     }
+    RowWriter w(fmt, list_columns(kind));
+    ListFilter f;
+    string after, next;
+    while(page_list(kind, f, after, MAX_PAGE_SIZE, next, [&](const Row &r){ w.row(r); })) after = next;
+    return true;
 }
 
-static void add_book(){
-    cout << "\n--- Add Book ---\n";
-    string bid = read_nonempty("Book ID (unique): ");
-    string title = read_nonempty("Title: ");
-    string author = prompt("Author: ");
-    string isbn = prompt("ISBN: ");
-    string publisher = prompt("Publisher: ");
-    string year = prompt("Year (YYYY): ");
-    string rack = prompt("Rack No.: ");
-    string copies_s = prompt("Copies (default 1): ");
-    int copies = copies_s.empty()? 1 : stoi(copies_s);
-    string sql = "INSERT OR REPLACE INTO books (book_id,isbn,title,author,publisher,year,rack,total_copies,available_copies) VALUES ('"
-        + escape_sql(bid) + "','" + escape_sql(isbn) + "','" + escape_sql(title) + "','" + escape_sql(author) + "','" + escape_sql(publisher) + "',"
-        + (year.empty()? "NULL": to_string(stoi(year))) + ",'" + escape_sql(rack) + "'," + to_string(copies) + "," + to_string(copies) + ");";
-    exec_sql(sql);
-    cout << "Book added/updated.\n";
+static int run_batch(istream &in, int batch_size){
+    auto t0 = chrono::steady_clock::now();
+    string line;
+    vector<string> words;
+    long lineno = 0, ok = 0, failed = 0, in_group = 0;
+    optional<Transaction> group;
+    while(getline(in, line)){
+        ++lineno;
+        split_words(line, words);
+        if(words.empty()) continue;
+        // gathered reads only see committed data (see Branch shards), so
+        // with branches the pending group goes in before a listing; it also
+        // goes in before any report or counter check, so that the flush
+        // they start includes the group's statistics (published at commit)
+        bool settle = words[0] == "report" || words[0] == "check-counters" || (words[0] == "list" && shard_count() > 1);
+        if(group && settle){ group->commit(); group.reset(); in_group = 0; }
+        if(!group) group.emplace();
+        ostringstream detail;
+        bool good;
+        try {
+            // its own savepoint, so a failing command undoes only itself
+            Transaction cmd;
+            good = run_command(words, detail);
+            cmd.commit();
+        } catch(const DbError &e){
+            good = false;
+            string_view msg = e.what();
+            detail << (e.busy()? "database busy: " : "database error: ") << msg.substr(0, msg.find('\n'));
+            // some errors roll back the whole group; its earlier commands are lost
+            if(sqlite3_get_autocommit(DB)){
+                cerr << "line " << lineno << ": transaction rolled back, " << in_group << " earlier command(s) undone\n";
+                group.reset();
+                in_group = 0;
+            }
+        }
+        (good? ok : failed)++;
+        cout << lineno << (good? " ok " : " err ") << words[0] << " " << detail.str() << "\n";
+        if(!group) continue;
+        if(++in_group >= batch_size){ group->commit(); group.reset(); in_group = 0; }
+    }
+    if(group) group->commit();
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cout.flush();
+    cerr << ok << " ok, " << failed << " failed in " << fixed << setprecision(3) << secs << "s ("
+         << (long)((ok + failed) / (secs > 0? secs : 1e-9)) << " ops/s)\n";
+    return failed == 0? 0 : 1;
 }
 
-static void update_book(){
-    cout << "\n--- Update Book ---\n";
-    string bid = read_nonempty("Book ID: ");
-    auto rows = query_sql("SELECT book_id,title,author,total_copies,available_copies FROM books WHERE book_id='" + escape_sql(bid) + "';");
-    if(rows.empty()){ cout << "Book not found.\n"; return; }
-    auto &r = rows[0];
-    cout << "Current Title: " << r[1] << " Author: " << r[2] << " Total: " << r[3] << " Avail: " << r[4] << "\n";
-    string title = prompt("New Title (leave blank): ");
-    string author = prompt("New Author (leave blank): ");
-    string copies_txt = prompt("New total copies (leave blank): ");
-    vector<string> updates;
-    if(!title.empty()) updates.push_back("title='" + escape_sql(title) + "'");
-    if(!author.empty()) updates.push_back("author='" + escape_sql(author) + "'");
-    if(!copies_txt.empty()){
-        int copies = stoi(copies_txt);
-        // adjust available by difference
-        int old_total = stoi(r[3]);
-        int diff = copies - old_total;
-        updates.push_back("total_copies=" + to_string(copies));
-        updates.push_back("available_copies = available_copies + " + to_string(diff));
-    }
-    if(!updates.empty()){
-        string sql = "UPDATE books SET " + accumulate(next(updates.begin()), updates.end(), updates[0],
-            [](const string &a, const string &b){ return a + ", " + b; }) + " WHERE book_id='" + escape_sql(bid) + "';";
-        exec_sql(sql);
-        cout << "Updated.\n";
-    } else cout << "Nothing changed.\n";
-}
+// -------------------- Benchmark --------------------
+// --bench [10k|1m|10m|N] [--ops N] [--db file] [--keep] builds a synthetic
+// library of N books (and N/5 members) shaped like data/books.csv and
+// data/members.csv in a scratch database, then times the circulation core
+// in phases: issue, search, overdue report, return. Each phase prints its
+// throughput and p50/p99/max latency so runs can be compared across changes.
+const int DEFAULT_BENCH_OPS = 20000;
+const char *const BENCH_DB = "bench.db";
 
-static void remove_book(){
-    cout << "\n--- Remove Book ---\n";
-    string bid = read_nonempty("Book ID: ");
-    auto rows = query_sql("SELECT total_copies,available_copies FROM books WHERE book_id='" + escape_sql(bid) + "';");
-    if(rows.empty()){ cout << "Book not found.\n"; return; }
-    int total = stoi(rows[0][0]), avail = stoi(rows[0][1]);
-    if(total != avail){ cout << "Cannot remove: some copies are borrowed.\n"; return; }
-    exec_sql("DELETE FROM books WHERE book_id='" + escape_sql(bid) + "';");
-    cout << "Removed.\n";
-}
+static const char *const BENCH_SUBJECTS[] = {
+    "Modern Control Engineering", "Cryptography and Network Security", "Cloud Computing",
+    "Artificial Intelligence", "Wireless Communications", "Software Engineering", "Digital Design",
+    "Deep Learning", "Computer Networks", "Pattern Recognition", "Machine Learning",
+    "Introduction to Algorithms", "Database System Concepts", "Data Mining Concepts", "Compiler Design",
+    "The C++ Programming Language", "Quantum Computing", "Operating System Concepts", "Distributed Systems",
+    "Big Data Analytics"};
+static const char *const BENCH_QUALIFIERS[] = {
+    "Fundamentals", "Principles", "Handbook", "Essentials", "Advanced", "Applied", "Practice", "Theory",
+    "Foundations", "Methods"};
+static const char *const BENCH_AUTHORS[] = {
+    "Abraham Silberschatz", "Alfred Aho", "Andrew S. Tanenbaum", "Bjarne Stroustrup", "Christopher Bishop",
+    "Galvin", "Ian Goodfellow", "Ian Sommerville", "Jiawei Han", "M. Morris Mano", "Michael Nielsen", "Ogata",
+    "Rajkumar Buyya", "Stuart Russell", "Tanenbaum & Van Steen", "Theodore Rappaport", "Thomas H. Cormen",
+    "Tom Mitchell", "William Stallings"};
+static const char *const BENCH_NAMES[] = {
+    "Ravi", "Neha", "Kiran", "Divya", "Arjun", "Priya", "Amit", "Sneha", "Rahul", "Anita"};
+static const char *const BENCH_SURNAMES[] = {
+    "Yadav", "Sharma", "Gupta", "Das", "Iyer", "Singh", "Reddy", "Nair", "Patel", "Mehta"};
 
-static void add_staff(){
-    cout << "\n--- Add Staff ---\n";
-    string sid = read_nonempty("Staff ID: ");
-    string name = read_nonempty("Name: ");
-    string pwd = prompt("Password: ");
-    string sql = "INSERT OR REPLACE INTO users (id,name,password,role,category) VALUES ('" + escape_sql(sid) + "','" + escape_sql(name) + "','" + escape_sql(pwd) + "','staff', NULL);";
-    exec_sql(sql);
-    cout << "Staff added.\n";
-}
+template<class T, size_t N>
+static constexpr size_t count_of(T (&)[N]){ return N; }
 
-static void list_users(){
-    auto rows = query_sql("SELECT id,name,role,category FROM users;");
-    cout << "\nUsers:\n";
-    for(auto &r: rows) cout << r[0] << " | " << r[1] << " | " << r[2] << " | " << r[3] << "\n";
-}
+static string bench_isbn(long i){ return to_string(9780000000000LL + i * 7919 % 10000000000LL); }
 
-// -------------------- Staff functions --------------------
-static void add_member(){
-    cout << "\n--- Add Member ---\n";
-    string mid = read_nonempty("Member ID: ");
-    string name = read_nonempty("Name: ");
-    string category;
-    while(true){
-        category = prompt("Category (student/faculty/staff): ");
-        for(auto &c: category) c = tolower(c);
-        if(category=="student"||category=="faculty"||category=="staff") break;
-        cout << "Invalid category\n";
+static void bench_populate(long books, long members, mt19937_64 &rng){
+    auto t0 = chrono::steady_clock::now();
+    exec_script("CREATE TEMP TABLE IF NOT EXISTS import_books (book_id TEXT, title TEXT, author TEXT, isbn TEXT, copies INTEGER);");
+    char title[160];
+    optional<Transaction> tx;
+    for(long i = 1; i <= books; ++i){
+        if(!tx) tx.emplace();
+        snprintf(title, sizeof(title), "%s %s Vol. %ld", BENCH_SUBJECTS[rng() % count_of(BENCH_SUBJECTS)],
+                 BENCH_QUALIFIERS[rng() % count_of(BENCH_QUALIFIERS)], (long)(rng() % 50 + 1));
+        exec_sql("INSERT INTO temp.import_books VALUES (?,?,?,?,?);", to_string(i), (const char*)title,
+                 BENCH_AUTHORS[rng() % count_of(BENCH_AUTHORS)], bench_isbn(i), (int)(rng() % 10 + 1));
+        if(i % IMPORT_BATCH == 0){ flush_book_batch(); tx->commit(); tx.reset(); }
     }
-    string pwd = prompt("Password: ");
-    string sql = "INSERT OR REPLACE INTO users (id,name,password,role,category) VALUES ('" + escape_sql(mid) + "','" + escape_sql(name) + "','" + escape_sql(pwd) + "','member','" + escape_sql(category) + "');";
-    exec_sql(sql);
-    cout << "Member added.\n";
+    if(tx){ flush_book_batch(); tx->commit(); tx.reset(); }
+    static const int cats[] = {(int)MemberCategory::Student, (int)MemberCategory::Student, (int)MemberCategory::Student,
+                               (int)MemberCategory::Faculty, (int)MemberCategory::Staff};
+    char name[64];
+    for(long i = 1; i <= members; ++i){
+        if(!tx) tx.emplace();
+        snprintf(name, sizeof(name), "%s %s", BENCH_NAMES[rng() % count_of(BENCH_NAMES)], BENCH_SURNAMES[rng() % count_of(BENCH_SURNAMES)]);
+        string id = "M" + to_string(i);
+        exec_sql("INSERT INTO users (id,name,password,role,category) VALUES (?1,?2,?1," SQL_MEMBER ",?3);", id, (const char*)name, cats[rng() % 5]);
+        if(i % IMPORT_BATCH == 0){ tx->commit(); tx.reset(); }
+    }
+    if(tx) tx->commit();
+    exec_script("ANALYZE;");
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cout << "populated " << books << " books, " << members << " members in " << fixed << setprecision(2) << secs << "s\n";
 }
 
-static void list_members(){
-    auto rows = query_sql("SELECT id,name,category FROM users WHERE role='member';");
-    cout << "\nMembers:\n";
-    for(auto &r: rows) cout << r[0] << " | " << r[1] << " | " << r[2] << "\n";
+// Collects per-operation latencies for one phase.
+struct BenchPhase {
+    const char *name;
+    vector<double> us{};
+    long failed = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    template<class Op>
+    void run(Op &&op){
+        auto t = chrono::steady_clock::now();
+        bool ok = op();
+        us.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - t).count());
+        if(!ok) ++failed;
+    }
+
+    void report(){
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if(us.empty()){ cout << left << setw(10) << name << "no operations\n"; return; }
+        vector<double> s = us;
+        sort(s.begin(), s.end());
+        auto pct = [&](double p){ return s[min(s.size() - 1, (size_t)(p * s.size()))]; };
+        cout << left << setw(10) << name << right << setw(9) << s.size() << " ops " << setw(11) << fixed << setprecision(0)
+             << s.size() / (secs > 0? secs : 1e-9) << " ops/s  p50 " << setw(8) << setprecision(1) << pct(0.50)
+             << "us  p99 " << setw(9) << pct(0.99) << "us  max " << setw(10) << s.back() << "us";
+        if(failed) cout << "  (" << failed << " refused)";
+        cout << "\n";
+    }
+};
+
+static int run_bench(long books, int ops){
+    mt19937_64 rng(42);
+    long members = max(100L, books / 5);
+    bench_populate(books, members, rng);
+    cout.flush();
+
+    vector<TxnId> open;
+    open.reserve(ops);
+    BenchPhase issue{"issue"};
+    for(int i = 0; i < ops; ++i){
+        string mid = "M" + to_string(rng() % members + 1), bid = to_string(rng() % books + 1);
+        issue.run([&]{
+            auto res = issue_book_core(mid, bid);
+            if(res.status == Status::Ok) open.push_back(res.txn);
+            return res.status == Status::Ok;
+        });
+    }
+    issue.report();
+
+    BenchPhase search{"search"};
+    long hits = 0;
+    for(int i = 0; i < ops / 10; ++i){
+        string q = i % 2? bench_isbn(rng() % books + 1)
+                        : string(BENCH_SUBJECTS[rng() % count_of(BENCH_SUBJECTS)]).substr(0, 5) + " " +
+                          string(BENCH_QUALIFIERS[rng() % count_of(BENCH_QUALIFIERS)]).substr(0, 4);
+        search.run([&]{ long n = 0; find_books(q, [&](const Row &){ ++n; }); hits += n; return n > 0; });
+    }
+    search.report();
+
+    // a subject or author word with one letter dropped; the first run also
+    // builds the index
+    BenchPhase fuzzy{"fuzzy"};
+    for(int i = 0; i < ops / 10; ++i){
+        string q = i % 2? BENCH_AUTHORS[rng() % count_of(BENCH_AUTHORS)] : BENCH_SUBJECTS[rng() % count_of(BENCH_SUBJECTS)];
+        q = q.substr(0, q.find(' '));
+        if(q.size() > 3) q.erase(1 + rng() % (q.size() - 1), 1);
+        fuzzy.run([&]{ long n = 0; find_books(q, [&](const Row &){ ++n; }); hits += n; return n > 0; });
+    }
+    fuzzy.report();
+
+    // backdate a quarter of the open loans so the overdue report has work
+    exec_sql("UPDATE transactions SET issue_date = issue_date - 40 * 86400, due_date = due_date - 40 * 86400 "
+             "WHERE status=" SQL_BORROWED " AND txn_id % 4 = 0;");
+    BenchPhase overdue{"overdue"};
+    long rows = 0;
+    for(int i = 0; i < 20; ++i) overdue.run([&]{ for_each_overdue([&](const Row &){ ++rows; }); return true; });
+    overdue.report();
+
+    shuffle(open.begin(), open.end(), rng);
+    BenchPhase ret{"return"};
+    for(TxnId t: open) ret.run([&]{ return return_book_core(t).status == Status::Ok; });
+    ret.report();
+
+    cout << "search matched " << hits << " rows; overdue scanned " << rows << " rows\n";
+    return 0;
 }
 
-static void issue_book(){
-    cout << "\n--- Issue Book ---\n";
-    string mid = read_nonempty("Member ID: ");
-    auto mrows = query_sql("SELECT id,category FROM users WHERE id='" + escape_sql(mid) + "' AND role='member';");
-    if(mrows.empty()){ cout << "Member not found.\n"; return; }
-    string cat = mrows[0][1];
-    string bid = read_nonempty("Book ID: ");
-    auto brows = query_sql("SELECT book_id,available_copies FROM books WHERE book_id='" + escape_sql(bid) + "';");
-    if(brows.empty()){ cout << "Book not found.\n"; return; }
-    int avail = stoi(brows[0][1]);
-    if(avail < 1){ cout << "No copies available. Consider reserving.\n"; return; }
+// -------------------- HTTP service --------------------
+// --serve [port] [--threads N] answers JSON requests for kiosks and the OPAC:
+//   GET  /search?q=...               GET /reports/overdue   GET /reports/top?n=..   GET /reports/cache
+//   GET  /reports/daily?days=..      GET /reports/categories     GET /metrics
+//   GET  /books /users /members /borrowed   ?after=..&limit=.. plus filters
+//        (available, author, role, member, overdue); "next" resumes the list
+//   POST /issue?member=..&book=..    POST /return?txn=..    POST /reserve?member=..&book=..
+//   POST /cancel?member=..&book=..
+//   POST /issue?member=..&books=a,b,..   POST /return?txns=t1,t2,..   (desk stacks)
+//   GET  /changes?after=<cursor>&limit=..&wait=<ms>   circulation events after the cursor;
+//        with wait, holds the request until there are some (see Change log)
+// Parameters come from the query string or a form-encoded body. An acceptor
+// queues connections for a fixed pool of workers, each with its own WAL
+// connection: catalog reads run in parallel, writes queue on their shard's
+// WRITE_LOCKS entry.
+// Private connections rather than shared-cache, which would lock at table level.
+const int DEFAULT_PORT = 8080;
+const int PROFILE_DUMP_SECS = 30;
 
-    // borrow limit
-    auto rcnt = query_sql("SELECT COUNT(*) FROM transactions WHERE member_id='" + escape_sql(mid) + "' AND status='borrowed';");
-    int borrowed_count = rcnt.empty()? 0 : stoi(rcnt[0][0]);
-    int limit = 5;
-    if(cat=="faculty") limit = 10;
-    else if(cat=="staff") limit = 7;
-    if(borrowed_count >= limit){ cout << "Borrow limit reached (" << limit << ")\n"; return; }
-
-    // issue
-    auto issue = now_iso();
-    int days = (cat=="faculty"? DEFAULT_BORROW_FACULTY : (cat=="staff"? DEFAULT_BORROW_STAFF : DEFAULT_BORROW_STUDENT));
-    // compute due date (YYYY-MM-DD)
-    // For simplicity, compute by adding days to current time_t and format as ISO
-    time_t t = time(nullptr);
-    t += days * 24 * 3600;
-    tm tm_due{}; gmtime_r(&t, &tm_due);
-    char buf[32]; strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm_due);
-    string due = string(buf);
-    // txn id
-    long long ts = chrono::duration_cast<chrono::milliseconds>(
-        chrono::system_clock::now().time_since_epoch()).count();
-    string txn = "TX" + to_string(ts);
-    string sql = "INSERT INTO transactions (txn_id,member_id,book_id,issue_date,due_date,status) VALUES ('" + escape_sql(txn) + "','" + escape_sql(mid) + "','" + escape_sql(bid) + "','" + escape_sql(issue) + "','" + escape_sql(due) + "','borrowed');";
-    exec_sql(sql);
-    exec_sql("UPDATE books SET available_copies = available_copies - 1, borrowed_count = borrowed_count + 1 WHERE book_id='" + escape_sql(bid) + "';");
-    cout << "Issued. TxnID=" << txn << " Due: " << due.substr(0,10) << "\n";
+static volatile sig_atomic_t SERVER_STOP = 0;
+static void stop_server(int){ SERVER_STOP = 1; }
+
+static string url_decode(string_view s){
+    string out;
+    out.reserve(s.size());
+    for(size_t i=0;i<s.size();++i){
+        if(s[i] == '+') out += ' ';
+        else if(s[i] == '%' && i + 2 < s.size() && isxdigit((unsigned char)s[i+1]) && isxdigit((unsigned char)s[i+2])){
+            out += (char)stoi(string(s.substr(i+1, 2)), nullptr, 16);
+            i += 2;
+        } else out += s[i];
+    }
+    return out;
 }
 
-static void return_book(){
-    cout << "\n--- Return Book ---\n";
-    string txn = read_nonempty("Transaction ID: ");
-    auto rows = query_sql("SELECT txn_id,member_id,book_id,issue_date,due_date,return_date,status FROM transactions WHERE txn_id='" + escape_sql(txn) + "';");
-    if(rows.empty()){ cout << "Transaction not found.\n"; return; }
-    auto &r = rows[0];
-    if(r[6] == "returned"){ cout << "Already returned.\n"; return; }
-    // compute fine
-    string due = r[4];
-    string ret = now_iso();
-    // compute overdue days
-    string due_date_only = due.substr(0,10);
-    string ret_date_only = ret.substr(0,10);
-    // Use tm parsing
-    tm td{}; tm tr{};
-    strptime(due_date_only.c_str(), "%Y-%m-%d", &td);
-    strptime(ret_date_only.c_str(), "%Y-%m-%d", &tr);
-    time_t tt_due = timegm(&td);
-    time_t tt_ret = timegm(&tr);
-    long overdue = 0;
-    if (tt_ret > tt_due) overdue = (tt_ret - tt_due) / 86400;
-    int fine = (overdue > 0) ? overdue * FINE_PER_DAY : 0;
-    // update transaction
-    string sql = "UPDATE transactions SET return_date='" + escape_sql(ret) + "', fine=" + to_string(fine) + ", status='returned' WHERE txn_id='" + escape_sql(txn) + "';";
-    exec_sql(sql);
-    // free book
-    string bid = r[2];
-    exec_sql("UPDATE books SET available_copies = available_copies + 1 WHERE book_id='" + escape_sql(bid) + "';");
-    cout << "Book returned. Fine: ₹" << fine << "\n";
-
-    // check reservations
-    auto res = query_sql("SELECT res_id,member_id FROM reservations WHERE book_id='" + escape_sql(bid) + "' AND status='waiting' ORDER BY res_date LIMIT 1;");
-    if(!res.empty()){
-        string res_id = res[0][0];
-        string next_member = res[0][1];
-        exec_sql("UPDATE reservations SET status='fulfilled' WHERE res_id=" + res_id + ";");
-        // auto-issue to next_member
-        // determine category
-        auto catRows = query_sql("SELECT category FROM users WHERE id='" + escape_sql(next_member) + "';");
-        string cat = (catRows.empty() ? "student" : catRows[0][0]);
-        int days = (cat=="faculty"? DEFAULT_BORROW_FACULTY : (cat=="staff"? DEFAULT_BORROW_STAFF : DEFAULT_BORROW_STUDENT));
-        time_t tt = time(nullptr);
-        tt += days * 24 * 3600;
-        tm tm_due{}; gmtime_r(&tt, &tm_due);
-        char buf2[32];
-        strftime(buf2, sizeof(buf2), "%Y-%m-%dT%H:%M:%S", &tm_due);
-        string due2 = string(buf2);
-        long long ts2 = chrono::duration_cast<chrono::milliseconds>(
-            chrono::system_clock::now().time_since_epoch()).count();
-        string new_txn = "TX" + to_string(ts2);
-        string issue_time = now_iso();
-        string isql = "INSERT INTO transactions (txn_id,member_id,book_id,issue_date,due_date,status) VALUES ('" + escape_sql(new_txn) + "','" + escape_sql(next_member) + "','" + escape_sql(bid) + "','" + escape_sql(issue_time) + "','" + escape_sql(due2) + "','borrowed');";
-        exec_sql(isql);
-        exec_sql("UPDATE books SET available_copies = available_copies - 1, borrowed_count = borrowed_count + 1 WHERE book_id='" + escape_sql(bid) + "';");
-        cout << "Reservation fulfilled: issued to " << next_member << " Txn " << new_txn << "\n";
+static void parse_params(string_view s, unordered_map<string, string> &params){
+    while(!s.empty()){
+        size_t amp = s.find('&');
+        string_view kv = s.substr(0, amp);
+        size_t eq = kv.find('=');
+        if(!kv.empty()) params[url_decode(kv.substr(0, eq))] = eq == string_view::npos? string() : url_decode(kv.substr(eq + 1));
+        if(amp == string_view::npos) break;
+        s.remove_prefix(amp + 1);
     }
 }
 
-static void reserve_book(){
-    cout << "\n--- Reserve Book ---\n";
-    string mid = read_nonempty("Member ID: ");
-    string bid = read_nonempty("Book ID: ");
-    auto rows = query_sql("SELECT available_copies FROM books WHERE book_id='" + escape_sql(bid) + "';");
-    if(rows.empty()){ cout << "Book not found.\n"; return; }
-    int avail = stoi(rows[0][0]);
-    if(avail > 0){ cout << "Book is available now; borrow instead.\n"; return; }
-    string t = now_iso();
-    exec_sql("INSERT INTO reservations (book_id,member_id,res_date,status) VALUES ('" + escape_sql(bid) + "','" + escape_sql(mid) + "','" + escape_sql(t) + "','waiting');");
-    cout << "Reserved (FIFO). You'll be allocated when a copy is returned.\n";
+struct HttpRequest {
+    string method, path;
+    unordered_map<string, string> params;
+};
+
+// Reads one request off the socket; false on malformed or oversized input.
+static bool read_request(int fd, HttpRequest &req){
+    const size_t MAX_REQUEST = 1 << 16;
+    string buf;
+    size_t header_end;
+    char chunk[4096];
+    while((header_end = buf.find("\r\n\r\n")) == string::npos){
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if(n <= 0 || buf.size() > MAX_REQUEST) return false;
+        buf.append(chunk, (size_t)n);
+    }
+    string_view head(buf.data(), header_end);
+    size_t sp1 = head.find(' '), sp2 = head.find(' ', sp1 + 1);
+    if(sp1 == string_view::npos || sp2 == string_view::npos) return false;
+    req.method = string(head.substr(0, sp1));
+    string_view target = head.substr(sp1 + 1, sp2 - sp1 - 1);
+    size_t q = target.find('?');
+    req.path = string(target.substr(0, q));
+    if(q != string_view::npos) parse_params(target.substr(q + 1), req.params);
+
+    size_t content_length = 0;
+    size_t pos = 0;
+    while((pos = head.find("\r\n", pos)) != string_view::npos){
+        pos += 2;
+        string_view line = head.substr(pos, head.find("\r\n", pos) - pos);
+        if(line.size() > 15 && strncasecmp(line.data(), "content-length:", 15) == 0){
+            int len = 0;
+            if(!parse_int(line.substr(15), len) || len < 0 || (size_t)len > MAX_REQUEST) return false;
+            content_length = (size_t)len;
+        }
+    }
+    size_t body_start = header_end + 4;
+    while(buf.size() < body_start + content_length){
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if(n <= 0) return false;
+        buf.append(chunk, (size_t)n);
+    }
+    parse_params(string_view(buf).substr(body_start, content_length), req.params);
+    return true;
 }
 
-static void list_borrowed(){
-    auto rows = query_sql("SELECT txn_id,member_id,book_id,issue_date,due_date FROM transactions WHERE status='borrowed';");
-    cout << "\nCurrently Borrowed:\n";
-    for(auto &r: rows){
-        cout << r[0] << " | Member:" << r[1] << " | Book:" << r[2] << " | Issue:" << r[3].substr(0,10) << " | Due:" << r[4].substr(0,10) << "\n";
+static void send_all(int fd, const string &data){
+    size_t off = 0;
+    while(off < data.size()){
+        ssize_t n = send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+        if(n <= 0) return;
+        off += (size_t)n;
     }
 }
 
-// -------------------- Member functions --------------------
-static void search_books(){
-    cout << "--- Search Books ---\n";
-    string q = prompt("Query (title/author/isbn): ");
-    string like = "%" + q + "%";
-    // Using LIKE with escaped value (simple)
-    auto rows = query_sql("SELECT book_id,isbn,title,author,available_copies FROM books WHERE title LIKE '%" + escape_sql(q) + "%' OR author LIKE '%" + escape_sql(q) + "%' OR isbn LIKE '%" + escape_sql(q) + "%';");
-    cout << "\nSearch Results:\n";
-    for(auto &r: rows) cout << r[0] << " | " << r[2] << " | " << r[3] << " | Avail:" << r[4] << "\n";
+static void send_json(int fd, int code, const string &body){
+    const char *reason = code == 200? "OK" : code == 400? "Bad Request" : code == 404? "Not Found" :
+                         code == 405? "Method Not Allowed" : code == 409? "Conflict" :
+                         code == 503? "Service Unavailable" : "Internal Server Error";
+    string resp = "HTTP/1.1 " + to_string(code) + " " + reason + "\r\nContent-Type: application/json\r\n"
+                  "Content-Length: " + to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    send_all(fd, resp);
 }
 
-static void my_borrowed(const User &user){
-    auto rows = query_sql("SELECT txn_id,book_id,issue_date,due_date,status,fine FROM transactions WHERE member_id='" + escape_sql(user.id) + "' ORDER BY issue_date DESC;");
-    cout << "\nMy Transactions:\n";
-    for(auto &r: rows){
-        cout << r[0] << " | " << r[1] << " | Issue:" << r[2].substr(0,10) << " | Due:" << r[3].substr(0,10) << " | Status:" << r[4] << " | Fine:" << r[5] << "\n";
+static string status_json(Status s){
+    string out = "{\"ok\":false,\"error\":";
+    json_string(out, status_text(s));
+    return out + "}";
+}
+
+// A failed desk stack names the item that stopped it.
+static string stack_status_json(Status s, const char *key, const string &failed){
+    string out = "{\"ok\":false,\"error\":";
+    json_string(out, status_text(s));
+    if(!failed.empty()){
+        out += ",\""; out += key; out += "\":";
+        json_string(out, failed);
     }
+    return out + "}";
 }
 
-static void return_book_member(const User &user){
-    string txn = read_nonempty("Txn ID to return: ");
-    // check ownership
-    auto rows = query_sql("SELECT txn_id FROM transactions WHERE txn_id='" + escape_sql(txn) + "' AND member_id='" + escape_sql(user.id) + "' AND status='borrowed';");
-    if(rows.empty()){ cout << "No matching borrowed transaction.\n"; return; }
-    // reuse return_book
-    return_book();
+// Runs one request on this worker's connection; returns the HTTP status.
+static int handle_request(const HttpRequest &req, string &body){
+    auto param = [&](const char *name) -> const string* {
+        auto it = req.params.find(name);
+        return it == req.params.end() || it->second.empty()? nullptr : &it->second;
+    };
+    bool get = req.method == "GET", post = req.method == "POST";
+    if(req.path == "/search"){
+        if(!get) return 405;
+        string q = param("q")? *param("q") : string();
+        body = "{\"ok\":true,\"results\":[";
+        bool first = true;
+        bool fuzzy = find_books(q, [&](const Row &r){
+            if(!first) body += ',';
+            first = false;
+            body += "{\"book_id\":"; json_string(body, r.text(0));
+            body += ",\"isbn\":"; json_string(body, r.text(1));
+            body += ",\"title\":"; json_string(body, r.text(2));
+            body += ",\"author\":"; json_string(body, r.text(3));
+            body += ",\"available\":" + to_string(r.integer(4)) + "}";
+        });
+        body += fuzzy? "],\"fuzzy\":true}" : "]}";
+        return 200;
+    }
+    ListKind kind;
+    if(req.path.size() > 1 && parse_list_kind(string_view(req.path).substr(1), kind)){
+        if(!get) return 405;
+        ListFilter f;
+        string after, next;
+        int limit = PAGE_SIZE;
+        for(auto &[k, v]: req.params)
+            if(!set_list_option(k, v, f, after, limit)){ body = "{\"ok\":false,\"error\":\"bad parameter\"}"; return 400; }
+        RowWriter rw(OutFormat::Json, list_columns(kind), nullptr);
+        bool more = page_list(kind, f, after, limit, next, [&](const Row &r){ rw.row(r); });
+        rw.finish();
+        body = "{\"ok\":true,\"results\":" + rw.str() + ",\"next\":";
+        if(more) json_string(body, next);
+        else body += "null";
+        body += "}";
+        return 200;
+    }
+    if(req.path == "/reports/overdue" || req.path == "/reports/top"){
+        if(!get) return 405;
+        bool overdue = req.path == "/reports/overdue";
+        RowWriter rw(OutFormat::Json, overdue? OVERDUE_COLUMNS : TOP_COLUMNS, nullptr);
+        if(overdue) for_each_overdue([&](const Row &t){ rw.row(t); });
+        else {
+            int n = DEFAULT_TOP_N;
+            if(const string *p = param("n")) if(!parse_int(*p, n) || n < 1 || n > 1000){ body = "{\"ok\":false,\"error\":\"n must be 1..1000\"}"; return 400; }
+            for_each_top_borrowed([&](const Row &r){ rw.row(r); }, n);
+        }
+        rw.finish();
+        body = "{\"ok\":true,\"results\":" + rw.str() + "}";
+        return 200;
+    }
+    if(req.path == "/reports/daily" || req.path == "/reports/categories"){
+        if(!get) return 405;
+        body = "{\"ok\":true,\"results\":[";
+        bool first = true;
+        if(req.path == "/reports/daily"){
+            int days = DEFAULT_STATS_DAYS;
+            if(const string *p = param("days")) if(!parse_int(*p, days) || days < 1){ body = "{\"ok\":false,\"error\":\"days must be positive\"}"; return 400; }
+            for_each_daily_stats([&](const Row &r){
+                if(!first) body += ',';
+                first = false;
+                body += "{\"day\":"; json_string(body, date_text(r.int64(0) * SECS_PER_DAY).view());
+                body += ",\"issues\":" + to_string(r.int64(1)) + ",\"returns\":" + to_string(r.int64(2)) + ",\"fines\":" + to_string(r.int64(3)) + "}";
+            }, days);
+        } else {
+            for_each_category_loans([&](const Row &r){
+                if(!first) body += ',';
+                first = false;
+                body += "{\"category\":"; json_string(body, r.text(0));
+                body += ",\"loans\":" + to_string(r.int64(1)) + ",\"fines\":" + to_string(r.int64(2)) + "}";
+            });
+        }
+        body += "]}";
+        return 200;
+    }
+    if(req.path == "/metrics"){
+        if(!get) return 405;
+        auto p = page_cache_stats();
+        body = "{\"ok\":true,\"profiling\":" + string(PROFILE? "true" : "false")
+             + ",\"page_cache\":{\"hits\":" + to_string(p.hits) + ",\"misses\":" + to_string(p.misses)
+             + ",\"used_bytes\":" + to_string(p.used_bytes) + ",\"connections\":" + to_string(p.connections) + "},\"queries\":[";
+        bool first = true;
+        for(auto &[sql, s]: query_stats_snapshot()){
+            if(!first) body += ',';
+            first = false;
+            body += "{\"sql\":"; json_string(body, sql);
+            body += ",\"calls\":" + to_string(s.calls) + ",\"rows\":" + to_string(s.rows)
+                  + ",\"total_us\":" + to_string(s.total_ns / 1000) + ",\"max_us\":" + to_string(s.max_ns / 1000)
+                  + ",\"p50_us\":" + to_string(s.percentile_us(0.50)) + ",\"p99_us\":" + to_string(s.percentile_us(0.99))
+                  + ",\"fullscan_steps\":" + to_string(s.fullscan) + ",\"sorts\":" + to_string(s.sorts)
+                  + ",\"autoindex\":" + to_string(s.autoindex) + ",\"vm_steps\":" + to_string(s.vm_steps) + ",\"histogram_us\":[";
+            for(int i = 0; i < LATENCY_BUCKETS; ++i) body += (i? "," : "") + to_string(s.hist[i]);
+            body += "]}";
+        }
+        body += "]}";
+        return 200;
+    }
+    if(req.path == "/changes"){
+        if(!get) return 405;
+        ChangeCursor cursor;
+        const string *after = param("after"), *lim = param("limit"), *wait = param("wait");
+        int limit = PAGE_SIZE, wait_ms = 0;
+        if(!parse_cursor(after? *after : string(), cursor) || (lim && (!parse_int(*lim, limit) || limit < 1))
+           || (wait && (!parse_int(*wait, wait_ms) || wait_ms < 0))){
+            body = "{\"ok\":false,\"error\":\"after must be one seq per shard, limit and wait positive numbers\"}";
+            return 400;
+        }
+        limit = min(limit, MAX_PAGE_SIZE);
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(min(wait_ms, CHANGE_MAX_WAIT_MS));
+        string events;
+        auto add = [&](int s, const Row &r){
+            if(!events.empty()) events += ',';
+            change_json(events, s, r);
+        };
+        // the generation is read before each pass, so a commit in between
+        // ends the next wait at once
+        auto seen = change_generation();
+        while(read_changes(cursor, limit, add) == 0 && !SERVER_STOP){
+            auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+            if(left <= 0) break;
+            wait_for_changes(seen, (int)min<long long>(left, CHANGE_POLL_MS));
+            seen = change_generation();
+        }
+        body = "{\"ok\":true,\"cursor\":"; json_string(body, cursor_text(cursor));
+        body += ",\"events\":[" + events + "]}";
+        return 200;
+    }
+    if(req.path == "/reports/cache"){
+        if(!get) return 405;
+        body = "{\"ok\":true,\"size\":" + to_string(CATALOG.size()) + ",\"capacity\":" + to_string(CATALOG.capacity())
+             + ",\"hits\":" + to_string(CATALOG.hits.load()) + ",\"misses\":" + to_string(CATALOG.misses.load()) + "}";
+        return 200;
+    }
+    if(req.path == "/issue" && param("books")){
+        if(!post) return 405;
+        const string *member = param("member");
+        vector<string> bids;
+        stringstream ss(*param("books"));
+        for(string b; getline(ss, b, ',');) if(!b.empty()) bids.push_back(b);
+        if(!member || bids.empty()){ body = "{\"ok\":false,\"error\":\"member and books are required\"}"; return 400; }
+        auto res = issue_books_core(*member, bids);
+        if(res.status != Status::Ok){ body = stack_status_json(res.status, "book_id", res.failed); return 409; }
+        body = "{\"ok\":true,\"loans\":[";
+        for(size_t i = 0; i < res.loans.size(); ++i){
+            body += i? ",{\"book_id\":" : "{\"book_id\":"; json_string(body, bids[i]);
+            body += ",\"txn_id\":\"" + to_string(res.loans[i].txn) + "\",\"due\":"; json_string(body, date_text(res.loans[i].due).view());
+            body += "}";
+        }
+        body += "]}";
+        return 200;
+    }
+    if(req.path == "/issue" || req.path == "/reserve" || req.path == "/cancel"){
+        if(!post) return 405;
+        const string *member = param("member"), *book = param("book");
+        if(!member || !book){ body = "{\"ok\":false,\"error\":\"member and book are required\"}"; return 400; }
+        if(req.path == "/reserve"){
+            Status s = reserve_book_core(*member, *book);
+            if(s != Status::Ok){ body = status_json(s); return 409; }
+            body = "{\"ok\":true,\"position\":" + to_string(hold_position(*member, *book)) + "}";
+            return 200;
+        }
+        if(req.path == "/cancel"){
+            Status s = cancel_hold(*member, *book);
+            body = s == Status::Ok? "{\"ok\":true}" : status_json(s);
+            return s == Status::Ok? 200 : 409;
+        }
+        auto res = issue_book_core(*member, *book);
+        if(res.status != Status::Ok){ body = status_json(res.status); return 409; }
+        body = "{\"ok\":true,\"txn_id\":\"" + to_string(res.txn) + "\"";
+        body += ",\"due\":"; json_string(body, date_text(res.due).view());
+        body += "}";
+        return 200;
+    }
+    if(req.path == "/return" && param("txns")){
+        if(!post) return 405;
+        vector<TxnId> txns;
+        stringstream ss(*param("txns"));
+        for(string t; getline(ss, t, ',');){
+            if(t.empty()) continue;
+            if(!parse_txn_id(t, txns.emplace_back())){ body = "{\"ok\":false,\"error\":\"txns must be valid txn ids\"}"; return 400; }
+        }
+        if(txns.empty()){ body = "{\"ok\":false,\"error\":\"a valid txn is required\"}"; return 400; }
+        auto res = return_books_core(txns);
+        if(res.status != Status::Ok){ body = stack_status_json(res.status, "txn_id", res.failed); return 409; }
+        body = "{\"ok\":true,\"returns\":[";
+        for(size_t i = 0; i < txns.size(); ++i){
+            auto &r = res.returns[i];
+            body += (i? ",{\"txn_id\":\"" : "{\"txn_id\":\"") + to_string(txns[i]) + "\",\"fine\":" + to_string(r.fine);
+            if(r.next_txn != 0){
+                body += ",\"reissued\":{\"member_id\":"; json_string(body, r.next_member);
+                body += ",\"txn_id\":\"" + to_string(r.next_txn) + "\"}";
+            }
+            body += "}";
+        }
+        body += "]}";
+        return 200;
+    }
+    if(req.path == "/return"){
+        if(!post) return 405;
+        const string *txn = param("txn");
+        TxnId id;
+        if(!txn || !parse_txn_id(*txn, id)){ body = "{\"ok\":false,\"error\":\"a valid txn is required\"}"; return 400; }
+        auto res = return_book_core(id);
+        if(res.status != Status::Ok){ body = status_json(res.status); return 409; }
+        body = "{\"ok\":true,\"fine\":" + to_string(res.fine);
+        if(res.next_txn != 0){
+            body += ",\"reissued\":{\"member_id\":"; json_string(body, res.next_member);
+            body += ",\"txn_id\":\"" + to_string(res.next_txn) + "\"";
+            body += "}";
+        }
+        body += "}";
+        return 200;
+    }
+    return 404;
 }
 
-static void reserve_book_member(const User &user){
-    string bid = read_nonempty("Book ID to reserve: ");
-    auto rows = query_sql("SELECT available_copies FROM books WHERE book_id='" + escape_sql(bid) + "';");
-    if(rows.empty()){ cout << "Book not found.\n"; return; }
-    int avail = stoi(rows[0][0]);
-    if(avail > 0){ cout << "Book available; you can borrow it instead.\n"; return; }
-    string t = now_iso();
-    exec_sql("INSERT INTO reservations (book_id,member_id,res_date,status) VALUES ('" + escape_sql(bid) + "','" + escape_sql(user.id) + "','" + escape_sql(t) + "','waiting');");
-    cout << "Reserved. You'll be notified when available.\n";
+// Connections waiting for a worker.
+struct ConnQueue {
+    mutex m;
+    condition_variable cv;
+    deque<int> fds;
+    bool closed = false;
+    void push(int fd){ { lock_guard<mutex> lk(m); fds.push_back(fd); } cv.notify_one(); }
+    void close(){ { lock_guard<mutex> lk(m); closed = true; } cv.notify_all(); }
+    // -1 once closed and drained
+    int pop(){
+        unique_lock<mutex> lk(m);
+        cv.wait(lk, [&]{ return !fds.empty() || closed; });
+        if(fds.empty()) return -1;
+        int fd = fds.front();
+        fds.pop_front();
+        return fd;
+    }
+};
+
+static void serve_worker(ConnQueue &queue){
+    open_db();
+    for(int fd; (fd = queue.pop()) >= 0;){
+        HttpRequest req;
+        if(read_request(fd, req)){
+            string body;
+            int code;
+            // a failed statement fails this request only
+            try { code = handle_request(req, body); }
+            catch(const DbError &e){
+                cerr << req.method << " " << req.path << ": " << e.what() << "\n";
+                code = e.busy()? 503 : 500;
+                body = e.busy()? "{\"ok\":false,\"error\":\"database busy, retry\"}" : "{\"ok\":false,\"error\":\"database error\"}";
+            }
+            if(body.empty()) body = "{\"ok\":false,\"error\":\"" + string(code == 404? "not found" : "method not allowed") + "\"}";
+            send_json(fd, code, body);
+        } else send_json(fd, 400, "{\"ok\":false,\"error\":\"malformed request\"}");
+        close(fd);
+    }
+    close_db();
 }
 
-// -------------------- Reports --------------------
-static void report_overdue(){
-    auto rows = query_sql("SELECT txn_id,member_id,book_id,issue_date,due_date FROM transactions WHERE status='borrowed';");
-    cout << "\nOverdue:\n";
-    for(auto &t: rows){
-        string due = t[4];
-        string now = now_iso();
-        // compare dates:
-        string due_date_only = due.substr(0,10);
-        string now_date_only = now.substr(0,10);
-        tm td{}; tm tn{};
-        strptime(due_date_only.c_str(), "%Y-%m-%d", &td);
-        strptime(now_date_only.c_str(), "%Y-%m-%d", &tn);
-        time_t tt_due = timegm(&td);
-        time_t tt_now = timegm(&tn);
-        if(tt_now > tt_due){
-            long overdue_days = (tt_now - tt_due) / 86400;
-            long fine = overdue_days * FINE_PER_DAY;
-            cout << "Txn:" << t[0] << " Member:" << t[1] << " Book:" << t[2] << " Due:" << due.substr(0,10) << " Days:" << overdue_days << " Fine:₹" << fine << "\n";
-        }
-    }
-}
-
-static void report_top_borrowed(){
-    auto rows = query_sql("SELECT book_id,title,borrowed_count FROM books ORDER BY borrowed_count DESC LIMIT 10;");
-    cout << "\nTop Borrowed Books:\n";
-    for(auto &r: rows) cout << r[0] << " | " << r[1] << " | Count:" << r[2] << "\n";
+// SIGINT/SIGTERM end the accept loop, so the server exits through the
+// normal path and the write-behind statistics get written.
+
+static int run_server(int port, int threads){
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if(listener < 0) die("socket() failed");
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)port);
+    if(::bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0) die("Cannot bind port " + to_string(port));
+    if(listen(listener, 128) != 0) die("listen() failed");
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction stop{};
+    stop.sa_handler = stop_server;          // no SA_RESTART: accept() returns EINTR
+    sigaction(SIGINT, &stop, nullptr);
+    sigaction(SIGTERM, &stop, nullptr);
+    // only this thread takes them; the others (and the threads they start) block them
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+
+    ConnQueue queue;
+    vector<thread> pool;
+    for(int i = 0; i < threads; ++i) pool.emplace_back(serve_worker, ref(queue));
+    // builds the fuzzy search index off the request path; a failure leaves
+    // it to the first fuzzy search
+    thread warm_fuzzy([]{
+        try { FUZZY.warm(); }
+        catch(const DbError &e){ cerr << e.what() << "\n"; }
+        close_db();
+    });
+    // long-running, so the profile file is refreshed rather than written at exit only
+    if(!PROFILE_FILE.empty()) thread([]{
+        while(true){ this_thread::sleep_for(chrono::seconds(PROFILE_DUMP_SECS)); dump_profile_file(); }
+    }).detach();
+    pthread_sigmask(SIG_UNBLOCK, &stop_signals, nullptr);
+    cerr << "Serving on port " << port << " with " << threads << " workers\n";
+    while(!SERVER_STOP){
+        int fd = accept(listener, nullptr, nullptr);
+        if(fd < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+        queue.push(fd);
+    }
+    close(listener);
+    // requests already accepted are answered first; long polls end early
+    queue.close();
+    wake_change_waiters();
+    for(auto &t: pool) t.join();
+    warm_fuzzy.join();
+    if(SERVER_STOP) cerr << "Shutting down\n";
+    return SERVER_STOP? 0 : 1;
 }
 
 // -------------------- Menus --------------------
+// A failed action is reported and the menu carries on; its writes were
+// rolled back with its Transaction.
+static void report_db_error(const DbError &e){
+    cerr << e.what() << "\n";
+    cout << (e.busy()? "The library database is busy; please try again.\n" : "Database error; nothing was changed.\n");
+}
+
 static void admin_menu(const User &user){
     while(true){
         cout << R"(
@@ -531,22 +4804,28 @@ static void admin_menu(const User &user){
 0) Logout
 )";
         string ch = prompt("Choice: ");
-        if(ch=="1") add_book();
-        else if(ch=="2") update_book();
-        else if(ch=="3") remove_book();
-        else if(ch=="4") list_books();
-        else if(ch=="5") add_staff();
-        else if(ch=="6") list_users();
-        else if(ch=="7"){
-            while(true){
-                cout << "Reports: 1) Overdue 2) Top Borrowed 0) Back\n";
-                string r = prompt("Choice: ");
-                if(r=="1") report_overdue();
-                else if(r=="2") report_top_borrowed();
-                else if(r=="0") break;
+        try {
+            if(ch=="1") add_book();
+            else if(ch=="2") update_book();
+            else if(ch=="3") remove_book();
+            else if(ch=="4") list_books();
+            else if(ch=="5") add_staff();
+            else if(ch=="6") list_users();
+            else if(ch=="7"){
+                while(true){
+                    cout << "Reports: 1) Overdue 2) Top Borrowed 3) Cache Stats 4) Check Counters 5) Circulation 6) Query Stats 0) Back\n";
+                    string r = prompt("Choice: ");
+                    if(r=="1") report_overdue();
+                    else if(r=="2") report_top_borrowed();
+                    else if(r=="3") report_cache_stats();
+                    else if(r=="4") report_counter_check();
+                    else if(r=="5") report_circulation();
+                    else if(r=="6") print_query_stats(cout);
+                    else if(r=="0") break;
+                }
             }
-        }
-        else if(ch=="0") break;
+            else if(ch=="0") break;
+        } catch(const DbError &e){ report_db_error(e); }
     }
 }
 
@@ -561,22 +4840,26 @@ static void staff_menu(const User &user){
 5) Reserve Book (for member)
 6) Borrowed List
 7) Reports
+8) Reservations
 0) Logout
 )";
         string ch = prompt("Choice: ");
-        if(ch=="1") add_member();
-        else if(ch=="2") list_members();
-        else if(ch=="3") issue_book();
-        else if(ch=="4") return_book();
-        else if(ch=="5") reserve_book();
-        else if(ch=="6") list_borrowed();
-        else if(ch=="7"){
-            cout << "Reports: 1) Overdue 2) Top Borrowed 0) Back\n";
-            string r = prompt("Choice: ");
-            if(r=="1") report_overdue();
-            else if(r=="2") report_top_borrowed();
-        }
-        else if(ch=="0") break;
+        try {
+            if(ch=="1") add_member();
+            else if(ch=="2") list_members();
+            else if(ch=="3") issue_book();
+            else if(ch=="4") return_book();
+            else if(ch=="5") reserve_book();
+            else if(ch=="6") list_borrowed();
+            else if(ch=="7"){
+                cout << "Reports: 1) Overdue 2) Top Borrowed 0) Back\n";
+                string r = prompt("Choice: ");
+                if(r=="1") report_overdue();
+                else if(r=="2") report_top_borrowed();
+            }
+            else if(ch=="8") manage_reservations();
+            else if(ch=="0") break;
+        } catch(const DbError &e){ report_db_error(e); }
     }
 }
 
@@ -588,43 +4871,202 @@ static void member_menu(const User &user){
 2) My Borrowed Books
 3) Return Book (by TxnID)
 4) Reserve Book
+5) Cancel Reservation
 0) Logout
 )";
         string ch = prompt("Choice: ");
-        if(ch=="1") search_books();
-        else if(ch=="2") my_borrowed(user);
-        else if(ch=="3") return_book_member(user);
-        else if(ch=="4") reserve_book_member(user);
-        else if(ch=="0") break;
+        try {
+            if(ch=="1") search_books();
+            else if(ch=="2") my_borrowed(user);
+            else if(ch=="3") return_book_member(user);
+            else if(ch=="4") reserve_book_member(user);
+            else if(ch=="5") cancel_reservation_member(user);
+            else if(ch=="0") break;
+        } catch(const DbError &e){ report_db_error(e); }
     }
 }
 
 // -------------------- Main --------------------
-int main(){
-    ios::sync_with_stdio(false);
-    cin.tie(nullptr);
+static int run_main(int argc, char **argv){
+
+    if(argc > 1 && string(argv[1]) == "--bench"){
+        long books = 10000;
+        int ops = DEFAULT_BENCH_OPS;
+        bool keep = false;
+        DB_PATH = BENCH_DB;
+        for(int i = 2; i < argc; ++i){
+            string a = argv[i];
+            int n;
+            if(a == "--ops" && i + 1 < argc){
+                if(!parse_int(argv[++i], ops) || ops < 1) die("--ops needs a positive number");
+            }
+            else if(a == "--db" && i + 1 < argc) DB_PATH = argv[++i];
+            else if(a == "--keep") keep = true;
+            else if(a == "10k") books = 10000;
+            else if(a == "1m") books = 1000000;
+            else if(a == "10m") books = 10000000;
+            else if(parse_int(a, n) && n > 0) books = n;
+            else die("Unknown bench option: " + a);
+        }
+        if(DB_PATH == DBFILE) die("--bench deletes its database; pick a scratch file, not " + DBFILE);
+        // always start from an empty database
+        for(const char *suffix: {"", "-wal", "-shm"}) unlink((DB_PATH + suffix).c_str());
+        init_db();
+        int rc = run_bench(books, ops);
+        stop_stats_writer();
+        close_db();
+        if(!keep) for(const char *suffix: {"", "-wal", "-shm"}) unlink((DB_PATH + suffix).c_str());
+        return rc;
+    }
 
+    init_shards();
     init_db();
 
+    if(argc > 1 && string(argv[1]) == "--import"){
+        vector<string> files(argv + 2, argv + argc);
+        if(files.empty()) files = {"data/books.csv", "data/members.csv"};
+        for(auto &f: files) import_csv(f);
+        close_db();
+        return 0;
+    }
+
+    if(argc > 2 && string(argv[1]) == "--export"){
+        string what = argv[2];
+        OutFormat fmt = OutFormat::Csv;
+        for(int i = 3; i < argc; ++i){
+            string a = argv[i];
+            if(a == "--format" && i + 1 < argc){
+                if(!parse_format(argv[++i], fmt)) die("--format must be table, csv or json");
+            }
+            else die("Unknown option: " + a);
+        }
+        int rc = export_listing(what, fmt)? 0 : 2;
+        close_db();
+        return rc;
+    }
+
+    if(argc > 2 && string(argv[1]) == "--snapshot"){
+        string base;
+        for(int i = 3; i < argc; ++i){
+            string a = argv[i];
+            if(a == "--since" && i + 1 < argc) base = argv[++i];
+            else die("Unknown option: " + a);
+        }
+        int rc = write_snapshot(argv[2], base);
+        close_db();
+        return rc;
+    }
+
+    if(argc > 2 && string(argv[1]) == "--restore"){
+        int rc = 0;
+        // a base snapshot followed by its incrementals, oldest first
+        for(int i = 2; i < argc && rc == 0; ++i) if(!restore_snapshot(argv[i])) rc = 1;
+        close_db();
+        return rc;
+    }
+
+    if(argc > 1 && string(argv[1]) == "--changes"){
+        string from;
+        bool follow = false;
+        for(int i = 2; i < argc; ++i){
+            string a = argv[i];
+            if(a == "--follow") follow = true;
+            else from = a;
+        }
+        int rc = run_changes(from, follow);
+        close_db();
+        return rc;
+    }
+
+    if(argc > 1 && string(argv[1]) == "--notices"){
+        string out = DEFAULT_NOTICE_FILE;
+        int threads = (int)thread::hardware_concurrency();
+        if(threads < 1) threads = 4;
+        for(int i = 2; i < argc; ++i){
+            string a = argv[i];
+            if(a == "--threads" && i + 1 < argc){
+                if(!parse_int(argv[++i], threads) || threads < 1) die("--threads needs a positive number");
+            }
+            else out = a;
+        }
+        int rc = run_notices(out, threads);
+        close_db();
+        return rc;
+    }
+
+    if(argc > 1 && string(argv[1]) == "--serve"){
+        int port = DEFAULT_PORT;
+        int threads = (int)thread::hardware_concurrency();
+        if(threads < 1) threads = 4;
+        for(int i = 2; i < argc; ++i){
+            string a = argv[i];
+            if(a == "--threads" && i + 1 < argc){
+                if(!parse_int(argv[++i], threads) || threads < 1) die("--threads needs a positive number");
+            }
+            else if(!parse_int(a, port) || port < 1 || port > 65535) die("Bad port: " + a);
+        }
+        int rc = run_server(port, threads);
+        close_db();
+        return rc;
+    }
+
+    if(argc > 1 && string(argv[1]) == "--batch"){
+        string file;
+        int batch_size = DEFAULT_BATCH_SIZE;
+        for(int i = 2; i < argc; ++i){
+            string a = argv[i];
+            if(a == "--batch-size" && i + 1 < argc){
+                if(!parse_int(argv[++i], batch_size) || batch_size < 1) die("--batch-size needs a positive number");
+            }
+            else file = a;
+        }
+        int rc;
+        if(file.empty() || file == "-") rc = run_batch(cin, batch_size);
+        else {
+            ifstream in(file);
+            if(!in) die("Cannot open " + file);
+            rc = run_batch(in, batch_size);
+        }
+        close_db();
+        return rc;
+    }
+
     cout << "=====================================\n  IITK - Campus Library Management\n=====================================\n";
     while(true){
         User user;
-        if(!login(user)){
+        bool ok;
+        try { ok = login(user); }
+        catch(const DbError &e){ report_db_error(e); ok = false; }
+        if(!ok){
             string t = prompt("Try again? (y/n): ");
             if(t != "y") break;
             else continue;
         }
-        if(user.role == "admin") admin_menu(user);
-        else if(user.role == "staff") staff_menu(user);
-        else if(user.role == "member") member_menu(user);
-        else cout << "Unknown role\n";
+        if(user.role == Role::Admin) admin_menu(user);
+        else if(user.role == Role::Staff) staff_menu(user);
+        else member_menu(user);
 
         cout << "Logged out.\n";
         string again = prompt("Login as another user? (y/n): ");
         if(again != "y") break;
     }
 
-    if(DB) sqlite3_close(DB);
+    close_db();
     cout << "Goodbye.\n";
     return 0;
 }
+
+int main(int argc, char **argv){
+    ios::sync_with_stdio(false);
+    cin.tie(nullptr);
+    init_profiling();
+    try {
+        return run_main(argc, argv);
+    } catch(const DbError &e){
+        // the one-shot modes and startup have nothing to fall back to
+        cout.flush();
+        cerr << e.what() << "\n";
+        close_db();
+        return 1;
+    }
+}